@@ -33,6 +33,11 @@
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,20)
 #include <linux/freezer.h>
 #endif
+#include <linux/sched.h>
+#include <linux/hash.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,27)
+#include <linux/rculist.h>
+#endif
 #include <linux/fs.h>
 #include <linux/slab.h>
 #include <redirfs.h>
@@ -42,9 +47,53 @@
 #define AVFLT_EVENT_OPEN	1
 #define AVFLT_EVENT_CLOSE	2
 
+/* max length of one request or reply, including the terminating zero */
+#define AVFLT_CMD_SIZE		256
+
 #define AVFLT_FILE_CLEAN	1
 #define AVFLT_FILE_INFECTED	2
 
+#define AVFLT_PRIO_HIGH		0
+#define AVFLT_PRIO_NORMAL	1
+#define AVFLT_PRIO_LOW		2
+#define AVFLT_PRIO_CLASSES	3
+
+#define AVFLT_DIGEST_SIZE	32
+
+struct avflt_fingerprint {
+	u8 digest[AVFLT_DIGEST_SIZE];
+	loff_t size;
+};
+
+#define AVFLT_POLICY_CHECK	0
+#define AVFLT_POLICY_SKIP	1
+#define AVFLT_POLICY_HEAD	2
+#define AVFLT_POLICY_EXTS_LEN	256
+
+#define AVFLT_OVERLOAD_BLOCK	0
+#define AVFLT_OVERLOAD_ALLOW	1
+#define AVFLT_OVERLOAD_DENY	2
+
+#define AVFLT_TIMEOUT_GLOBAL	-1
+#define AVFLT_TIMEOUT_ERROR	0
+#define AVFLT_TIMEOUT_ALLOW	1
+#define AVFLT_TIMEOUT_DENY	2
+#define AVFLT_TIMEOUT_RETRY	3
+
+/* how many times a timed out request is given to another scanner */
+#define AVFLT_RETRY_MAX		2
+
+/* deadline in msecs used when there is no reply timeout set */
+#define AVFLT_DEADLINE_DEFAULT	5000
+
+/* how many times an event is taken back from scanners missing the deadline */
+#define AVFLT_REQUEUE_MAX	2
+
+/* queue wait histogram, bucket n counts waits of 2^(n-1) to 2^n - 1 msecs */
+#define AVFLT_WAIT_BUCKETS	16
+
+struct avflt_proc;
+
 struct avflt_event {
 	struct list_head req_list;
 	struct list_head proc_list;
@@ -53,12 +102,24 @@ struct avflt_event {
 	atomic_t count;
 	int type;
 	int id;
+	int prio;
 	int result;
+	unsigned long queued;
+	unsigned long deadline;
+	unsigned long taken;
+	unsigned long expires;
+	pid_t owner;
+	pid_t excl;
+	int requeues;
+	loff_t limit;
+	struct avflt_fingerprint fp;
+	int fp_valid;
 	struct vfsmount *mnt;
 	struct dentry *dentry;
 	unsigned int flags;
 	struct file *file;
 	int fd;
+	int global_cache_ver;
 	int root_cache_ver;
 	int cache_ver;
 	int cache;
@@ -69,26 +130,37 @@ struct avflt_event {
 struct avflt_event *avflt_event_get(struct avflt_event *event);
 void avflt_event_put(struct avflt_event *event);
 void avflt_readd_request(struct avflt_event *event);
-struct avflt_event *avflt_get_request(void);
-int avflt_process_request(struct file *file, int type);
+struct avflt_event *avflt_get_request(struct avflt_proc *proc);
+int avflt_process_request(struct file *file, int type, loff_t limit,
+		struct avflt_fingerprint *fp);
 void avflt_event_done(struct avflt_event *event);
 int avflt_get_file(struct avflt_event *event);
 void avflt_put_file(struct avflt_event *event);
 void avflt_install_fd(struct avflt_event *event);
 ssize_t avflt_copy_cmd(char __user *buf, size_t size,
 		struct avflt_event *event);
-int avflt_add_reply(struct avflt_event *event);
-int avflt_request_empty(void);
+int avflt_add_reply(struct avflt_proc *proc, struct avflt_event *event);
+int avflt_proc_budget(struct avflt_proc *proc);
+int avflt_request_available(struct avflt_proc *proc);
 void avflt_start_accept(void);
 void avflt_stop_accept(void);
 int avflt_is_stopped(void);
 void avflt_rem_requests(void);
-struct avflt_event *avflt_get_reply(const char __user *buf, size_t size);
+struct avflt_event *avflt_get_reply(const char __user *buf, size_t size,
+		size_t *used);
+ssize_t avflt_queue_get_info(char *buf, int size);
+ssize_t avflt_overload_get_info(char *buf, int size);
+ssize_t avflt_cache_stats_get_info(char *buf, int size);
+ssize_t avflt_load_get_info(char *buf, int size);
 int avflt_check_init(void);
 void avflt_check_exit(void);
 
+#define AVFLT_TGID_HASH_BITS	6
+#define AVFLT_TGID_HASH_SIZE	(1 << AVFLT_TGID_HASH_BITS)
+
 struct avflt_trusted {
 	struct list_head list;
+	struct list_head hash;
 	pid_t tgid;
 	int open;
 };
@@ -98,13 +170,18 @@ void avflt_trusted_rem(pid_t tgid);
 int avflt_trusted_allow(pid_t tgid);
 ssize_t avflt_trusted_get_info(char *buf, int size);
 
+#define AVFLT_EVENT_HASH_BITS	8
+#define AVFLT_EVENT_HASH_SIZE	(1 << AVFLT_EVENT_HASH_BITS)
+
 struct avflt_proc {
 	struct list_head list;
-	struct list_head events; 
+	struct list_head hash;
+	struct list_head events[AVFLT_EVENT_HASH_SIZE];
 	spinlock_t lock;
 	atomic_t count;
 	pid_t tgid;
 	int open;
+	int inflight;
 };
 
 struct avflt_proc *avflt_proc_get(struct avflt_proc *proc);
@@ -114,10 +191,14 @@ struct avflt_proc *avflt_proc_add(pid_t tgid);
 void avflt_proc_rem(pid_t tgid);
 int avflt_proc_allow(pid_t tgid);
 int avflt_proc_empty(void);
+int avflt_proc_count(void);
 void avflt_proc_add_event(struct avflt_proc *proc, struct avflt_event *event);
-void avflt_proc_rem_event(struct avflt_proc *proc, struct avflt_event *event);
+int avflt_proc_rem_event(struct avflt_proc *proc, struct avflt_event *event);
 struct avflt_event *avflt_proc_get_event(struct avflt_proc *proc, int id);
+int avflt_proc_extend_event(struct avflt_proc *proc, int id,
+		unsigned long expires);
 ssize_t avflt_proc_get_info(char *buf, int size);
+void avflt_proc_init(void);
 
 #define rfs_to_root_data(ptr) \
 	container_of(ptr, struct avflt_root_data, rfs_data)
@@ -126,6 +207,11 @@ struct avflt_root_data {
 	struct redirfs_data rfs_data;
 	atomic_t cache_enabled;
 	atomic_t cache_ver;
+	spinlock_t lock;
+	loff_t policy_size;
+	int policy;
+	int timeout_policy;
+	char policy_exts[AVFLT_POLICY_EXTS_LEN];
 };
 
 struct avflt_root_data *avflt_get_root_data_root(redirfs_root root);
@@ -140,6 +226,7 @@ struct avflt_root_data *avflt_attach_root_data(redirfs_root root);
 struct avflt_inode_data {
 	struct redirfs_data rfs_data;
 	struct avflt_root_data *root_data;
+	int global_cache_ver;
 	int root_cache_ver;
 	int inode_cache_ver;
 	int cache_ver;
@@ -154,6 +241,15 @@ struct avflt_inode_data *avflt_attach_inode_data(struct inode *inode);
 int avflt_data_init(void);
 void avflt_data_exit(void);
 
+int avflt_fp_self(void);
+int avflt_fp_compute(struct file *file, struct avflt_fingerprint *fp);
+int avflt_fp_find(struct avflt_event *event);
+void avflt_fp_add(struct avflt_event *event);
+void avflt_fp_flush(void);
+int avflt_fp_available(void);
+void avflt_fp_init(void);
+void avflt_fp_exit(void);
+
 void avflt_invalidate_cache_root(redirfs_root root);
 void avflt_invalidate_cache(void);
 
@@ -167,9 +263,18 @@ int avflt_sys_init(void);
 void avflt_sys_exit(void);
 
 extern atomic_t avflt_reply_timeout;
+extern atomic_t avflt_timeout_policy;
+extern atomic_t avflt_queue_limit;
+extern atomic_t avflt_queue_policy;
+extern atomic_t avflt_proc_quota;
 extern atomic_t avflt_cache_enabled;
+extern atomic_t avflt_cache_ver;
+extern atomic_long_t avflt_cache_hits;
+extern atomic_long_t avflt_cache_misses;
+extern atomic_t avflt_fp_size_max;
 extern redirfs_filter avflt;
 extern wait_queue_head_t avflt_request_available;
+extern wait_queue_head_t avflt_request_space;
 
 #endif
 
@@ -23,15 +23,50 @@
 
 #include "avflt.h"
 
+struct avflt_queue {
+	struct list_head list;
+	int depth;
+	unsigned long dispatched;
+	unsigned int wait_max;
+	u64 wait_total;
+	unsigned long wait_hist[AVFLT_WAIT_BUCKETS];
+};
+
 DECLARE_WAIT_QUEUE_HEAD(avflt_request_available);
+DECLARE_WAIT_QUEUE_HEAD(avflt_request_space);
 static DEFINE_SPINLOCK(avflt_request_lock);
-static LIST_HEAD(avflt_request_list);
+static struct avflt_queue avflt_request_queues[AVFLT_PRIO_CLASSES];
+static int avflt_request_count = 0;
+static int avflt_request_hwm = 0;
+static unsigned long avflt_overload_blocked = 0;
+static unsigned long avflt_overload_allowed = 0;
+static unsigned long avflt_overload_denied = 0;
+static unsigned long avflt_arrivals_start = 0;
+static unsigned int avflt_arrivals = 0;
+static unsigned int avflt_arrival_rate = 0;
+static unsigned long avflt_load_notified = 0;
 static int avflt_request_accept = 0;
 static struct kmem_cache *avflt_event_cache = NULL;
 atomic_t avflt_cache_ver = ATOMIC_INIT(0);
+atomic_long_t avflt_cache_hits = ATOMIC_LONG_INIT(0);
+atomic_long_t avflt_cache_misses = ATOMIC_LONG_INIT(0);
 atomic_t avflt_event_ids = ATOMIC_INIT(0);
 
-static struct avflt_event *avflt_event_alloc(struct file *file, int type)
+static int avflt_event_prio(void)
+{
+	int nice = task_nice(current);
+
+	if (nice < 0)
+		return AVFLT_PRIO_HIGH;
+
+	if (nice > 0)
+		return AVFLT_PRIO_LOW;
+
+	return AVFLT_PRIO_NORMAL;
+}
+
+static struct avflt_event *avflt_event_alloc(struct file *file, int type,
+		loff_t limit, struct avflt_fingerprint *fp)
 {
 	struct avflt_inode_data *inode_data;
 	struct avflt_root_data *root_data;
@@ -53,11 +88,20 @@ static struct avflt_event *avflt_event_alloc(struct file *file, int type)
 	event->fd = -1;
 	event->pid = current->pid;
 	event->tgid = current->tgid;
+	event->prio = avflt_event_prio();
+	event->limit = limit;
 	event->cache = 1;
 
+	if (fp) {
+		memcpy(&event->fp, fp, sizeof(struct avflt_fingerprint));
+		event->fp_valid = 1;
+	}
+
 	root_data = avflt_get_root_data_inode(file->f_dentry->d_inode);
 	inode_data = avflt_get_inode_data_inode(file->f_dentry->d_inode);
 
+	event->global_cache_ver = atomic_read(&avflt_cache_ver);
+
 	if (root_data) 
 		event->root_cache_ver = atomic_read(&root_data->cache_ver);
 
@@ -102,8 +146,75 @@ void avflt_event_put(struct avflt_event *event)
 	kmem_cache_free(avflt_event_cache, event);
 }
 
+/*
+ * Let scanner supervisors polling the load attribute know that the queue has
+ * changed, at most ten times per second. Called without avflt_request_lock.
+ */
+static void avflt_load_notify(void)
+{
+	unsigned long notified = avflt_load_notified;
+	struct kobject *kobj;
+
+	if (time_before(jiffies, notified + HZ / 10))
+		return;
+
+	if (cmpxchg(&avflt_load_notified, notified, jiffies) != notified)
+		return;
+
+	kobj = redirfs_filter_kobject(avflt);
+	if (kobj && !IS_ERR(kobj))
+		sysfs_notify(kobj, NULL, "load");
+}
+
+static void avflt_count_arrival(void)
+{
+	unsigned long elapsed = jiffies - avflt_arrivals_start;
+
+	if (elapsed >= HZ) {
+		avflt_arrival_rate = avflt_arrivals * HZ / elapsed;
+		avflt_arrivals_start = jiffies;
+		avflt_arrivals = 0;
+	}
+
+	avflt_arrivals++;
+}
+
+static unsigned long avflt_event_period(void)
+{
+	int timeout;
+
+	/*
+	 * Give scanners half of the reply timeout to pick up the event. After
+	 * that the event is dispatched before any event from a higher class.
+	 * A scanner holding the event for the same time without a reply is
+	 * considered stuck and the event is given to another scanner.
+	 */
+	timeout = atomic_read(&avflt_reply_timeout) / 2;
+	if (!timeout)
+		timeout = AVFLT_DEADLINE_DEFAULT;
+
+	return msecs_to_jiffies(timeout);
+}
+
+static unsigned long avflt_event_deadline(void)
+{
+	return jiffies + avflt_event_period();
+}
+
+static int avflt_request_full(void)
+{
+	int limit = atomic_read(&avflt_queue_limit);
+
+	if (!limit || avflt_request_accept == 0)
+		return 0;
+
+	return avflt_request_count >= limit;
+}
+
 static int avflt_add_request(struct avflt_event *event, int tail)
 {
+	struct avflt_queue *queue = &avflt_request_queues[event->prio];
+
 	spin_lock(&avflt_request_lock);
 
 	if (avflt_request_accept == 0) {
@@ -111,26 +222,101 @@ static int avflt_add_request(struct avflt_event *event, int tail)
 		return 1;
 	}
 
-	if (tail)
-		list_add_tail(&event->req_list, &avflt_request_list);
-	else
-		list_add(&event->req_list, &avflt_request_list);
+	if (tail && avflt_request_full()) {
+		spin_unlock(&avflt_request_lock);
+		return -EBUSY;
+	}
 
+	if (tail) {
+		event->queued = jiffies;
+		event->deadline = avflt_event_deadline();
+		list_add_tail(&event->req_list, &queue->list);
+		avflt_count_arrival();
+	} else
+		list_add(&event->req_list, &queue->list);
+
+	queue->depth++;
+	if (++avflt_request_count > avflt_request_hwm)
+		avflt_request_hwm = avflt_request_count;
 	avflt_event_get(event);
 	
 	wake_up_interruptible(&avflt_request_available);
 
 	spin_unlock(&avflt_request_lock);
 
+	avflt_load_notify();
+
 	return 0;
 }
 
+static int avflt_request_not_full(void)
+{
+	int rv;
+
+	spin_lock(&avflt_request_lock);
+	rv = !avflt_request_full();
+	spin_unlock(&avflt_request_lock);
+
+	return rv;
+}
+
+/*
+ * Returns 0 when the event was queued, 1 when it was not queued and access
+ * should be allowed or a negative error.
+ */
+static int avflt_queue_request(struct avflt_event *event)
+{
+	int blocked = 0;
+	int rv;
+
+	while ((rv = avflt_add_request(event, 1)) == -EBUSY) {
+		spin_lock(&avflt_request_lock);
+
+		switch (atomic_read(&avflt_queue_policy)) {
+			case AVFLT_OVERLOAD_ALLOW:
+				avflt_overload_allowed++;
+				rv = 1;
+				break;
+
+			case AVFLT_OVERLOAD_DENY:
+				avflt_overload_denied++;
+				rv = -EPERM;
+				break;
+
+			default:
+				if (!blocked++)
+					avflt_overload_blocked++;
+				rv = 0;
+		}
+
+		spin_unlock(&avflt_request_lock);
+
+		if (rv)
+			return rv;
+
+		rv = wait_event_interruptible(avflt_request_space,
+				avflt_request_not_full());
+		if (rv)
+			return rv;
+	}
+
+	return rv;
+}
+
 void avflt_readd_request(struct avflt_event *event)
 {
 	if (avflt_add_request(event, 0))
 		avflt_event_done(event);
 }
 
+static void avflt_del_request(struct avflt_event *event)
+{
+	list_del_init(&event->req_list);
+	avflt_request_queues[event->prio].depth--;
+	avflt_request_count--;
+	wake_up_interruptible(&avflt_request_space);
+}
+
 static void avflt_rem_request(struct avflt_event *event)
 {
 	spin_lock(&avflt_request_lock);
@@ -138,55 +324,260 @@ static void avflt_rem_request(struct avflt_event *event)
 		spin_unlock(&avflt_request_lock);
 		return;
 	}
-	list_del_init(&event->req_list);
+	avflt_del_request(event);
 	spin_unlock(&avflt_request_lock);
 	avflt_event_put(event);
 }
 
-struct avflt_event *avflt_get_request(void)
+static struct avflt_event *avflt_first_event(struct avflt_queue *queue,
+		pid_t excl)
 {
 	struct avflt_event *event;
 
+	list_for_each_entry(event, &queue->list, req_list) {
+		if (!excl || event->excl != excl)
+			return event;
+	}
+
+	return NULL;
+}
+
+/*
+ * Events taken back from a stuck scanner are not given to the same scanner
+ * again, excl is its tgid or 0 when it is the only scanner left.
+ */
+static struct avflt_event *avflt_select_event(pid_t excl)
+{
+	struct avflt_event *expired = NULL;
+	struct avflt_event *first = NULL;
+	struct avflt_event *event;
+	int i;
+
+	for (i = 0; i < AVFLT_PRIO_CLASSES; i++) {
+		event = avflt_first_event(&avflt_request_queues[i], excl);
+		if (!event)
+			continue;
+
+		if (!first)
+			first = event;
+
+		if (time_before(jiffies, event->deadline))
+			continue;
+
+		if (expired && !time_before(event->deadline, expired->deadline))
+			continue;
+
+		expired = event;
+	}
+
+	if (expired)
+		return expired;
+
+	return first;
+}
+
+static pid_t avflt_proc_excl(struct avflt_proc *proc)
+{
+	if (!proc || avflt_proc_count() < 2)
+		return 0;
+
+	return proc->tgid;
+}
+
+struct avflt_event *avflt_get_request(struct avflt_proc *proc)
+{
+	struct avflt_event *event;
+	struct avflt_queue *queue;
+	unsigned int wait;
+	pid_t excl;
+
+	excl = avflt_proc_excl(proc);
+
 	spin_lock(&avflt_request_lock);
 
-	if (list_empty(&avflt_request_list)) {
+	event = avflt_select_event(excl);
+	if (!event) {
 		spin_unlock(&avflt_request_lock);
 		return NULL;
 	}
 
-	event = list_entry(avflt_request_list.next, struct avflt_event,
-			req_list);
-	list_del_init(&event->req_list);
+	queue = &avflt_request_queues[event->prio];
+	avflt_del_request(event);
+
+	wait = jiffies_to_msecs(jiffies - event->queued);
+	queue->dispatched++;
+	queue->wait_total += wait;
+	if (wait > queue->wait_max)
+		queue->wait_max = wait;
+	queue->wait_hist[min(fls(wait), AVFLT_WAIT_BUCKETS - 1)]++;
 
 	spin_unlock(&avflt_request_lock);
 
+	avflt_load_notify();
+
 	event->id = atomic_inc_return(&avflt_event_ids);
 	return event;
 }
 
-static int avflt_wait_for_reply(struct avflt_event *event)
+/*
+ * Takes the event back from a scanner which did not reply in time and puts it
+ * at the head of its queue, so it is picked up by another scanner. Only done
+ * when a reply timeout is set, without it scanners may take as long as they
+ * need.
+ */
+static void avflt_requeue_event(struct avflt_event *event)
 {
-	long jiffies;
-	int timeout;
+	struct avflt_proc *proc;
+	pid_t owner;
 
-	timeout = atomic_read(&avflt_reply_timeout);
-	if (timeout)
-		jiffies = msecs_to_jiffies(timeout);
-	else
-		jiffies = MAX_SCHEDULE_TIMEOUT;
+	if (!atomic_read(&avflt_reply_timeout))
+		return;
 
-	jiffies = wait_for_completion_interruptible_timeout(&event->wait,
-			jiffies);
+	owner = event->owner;
+	if (!owner || event->requeues >= AVFLT_REQUEUE_MAX)
+		return;
+
+	if (time_before(jiffies, event->taken + avflt_event_period()))
+		return;
 
-	if (jiffies < 0)
-		return (int)jiffies;
+	if (avflt_proc_count() < 2)
+		return;
+
+	proc = avflt_proc_find(owner);
+	if (!proc)
+		return;
 
-	if (!jiffies) {
-		printk(KERN_WARNING "avflt: wait for reply timeout\n");
-		return -ETIMEDOUT;
+	if (avflt_proc_rem_event(proc, event)) {
+		printk(KERN_WARNING "avflt: scanner %d missed deadline, "
+				"request re-queued\n", owner);
+		event->excl = owner;
+		event->requeues++;
+		avflt_readd_request(event);
 	}
 
-	return 0;
+	avflt_proc_put(proc);
+}
+
+/*
+ * Waits for the reply until event->expires, which may be pushed out by the
+ * scanner with a heartbeat reply. With no reply timeout set it waits forever.
+ */
+static int avflt_wait_for_reply(struct avflt_event *event, int timeout)
+{
+	unsigned long period;
+	long left;
+
+	for (;;) {
+		period = avflt_event_period();
+		left = period;
+
+		if (event->owner && time_before(jiffies, event->taken + period))
+			left = event->taken + period - jiffies;
+
+		if (timeout) {
+			if (!time_before(jiffies, event->expires))
+				return -ETIMEDOUT;
+
+			left = min_t(long, left, event->expires - jiffies);
+		}
+
+		left = wait_for_completion_interruptible_timeout(&event->wait,
+				left);
+
+		if (left < 0)
+			return (int)left;
+
+		if (left)
+			return 0;
+
+		avflt_requeue_event(event);
+	}
+}
+
+static int avflt_event_timeout_policy(struct avflt_event *event)
+{
+	int policy = AVFLT_TIMEOUT_GLOBAL;
+
+	if (event->root_data) {
+		spin_lock(&event->root_data->lock);
+		policy = event->root_data->timeout_policy;
+		spin_unlock(&event->root_data->lock);
+	}
+
+	if (policy == AVFLT_TIMEOUT_GLOBAL)
+		policy = atomic_read(&avflt_timeout_policy);
+
+	return policy;
+}
+
+/*
+ * Takes the timed out event back from its scanner, if any, and gives it to
+ * another one with a new reply timeout.
+ */
+static void avflt_retry_event(struct avflt_event *event, int timeout)
+{
+	struct avflt_proc *proc;
+	pid_t owner;
+
+	event->expires = jiffies + msecs_to_jiffies(timeout);
+
+	owner = event->owner;
+	if (!owner)
+		return;
+
+	proc = avflt_proc_find(owner);
+	if (!proc)
+		return;
+
+	if (avflt_proc_rem_event(proc, event)) {
+		event->excl = owner;
+		avflt_readd_request(event);
+	}
+
+	avflt_proc_put(proc);
+}
+
+/*
+ * Returns 0 when the reply arrived, 1 when there was no reply and access
+ * should be allowed or a negative error.
+ */
+static int avflt_wait_for_verdict(struct avflt_event *event)
+{
+	int retries = 0;
+	int timeout;
+	int rv;
+
+	timeout = atomic_read(&avflt_reply_timeout);
+	event->expires = jiffies + msecs_to_jiffies(timeout);
+
+	while ((rv = avflt_wait_for_reply(event, timeout)) == -ETIMEDOUT) {
+		switch (avflt_event_timeout_policy(event)) {
+			case AVFLT_TIMEOUT_ALLOW:
+				printk(KERN_WARNING "avflt: wait for reply "
+						"timeout, access allowed\n");
+				return 1;
+
+			case AVFLT_TIMEOUT_DENY:
+				printk(KERN_WARNING "avflt: wait for reply "
+						"timeout, access denied\n");
+				return -EPERM;
+
+			case AVFLT_TIMEOUT_RETRY:
+				if (retries++ < AVFLT_RETRY_MAX) {
+					avflt_retry_event(event, timeout);
+					break;
+				}
+
+				/* fall through */
+
+			default:
+				printk(KERN_WARNING "avflt: wait for reply "
+						"timeout\n");
+				return -ETIMEDOUT;
+		}
+	}
+
+	return rv;
 }
 
 static void avflt_update_cache(struct avflt_event *event)
@@ -218,28 +609,53 @@ static void avflt_update_cache(struct avflt_event *event)
 	spin_lock(&inode_data->lock);
 	avflt_put_root_data(inode_data->root_data);
 	inode_data->root_data = avflt_get_root_data(event->root_data);
+	inode_data->global_cache_ver = event->global_cache_ver;
 	inode_data->root_cache_ver = event->root_cache_ver;
 	inode_data->cache_ver = event->cache_ver;
 	inode_data->state = event->result;
 	spin_unlock(&inode_data->lock);
 	avflt_put_inode_data(inode_data);
+
+	if (event->fp_valid && event->result)
+		avflt_fp_add(event);
 }
 
-int avflt_process_request(struct file *file, int type)
+int avflt_process_request(struct file *file, int type, loff_t limit,
+		struct avflt_fingerprint *fp)
 {
 	struct avflt_event *event;
 	int rv = 0;
 
-	event = avflt_event_alloc(file, type);
+	event = avflt_event_alloc(file, type, limit, fp);
 	if (IS_ERR(event))
 		return PTR_ERR(event);
 
-	if (avflt_add_request(event, 1))
+	if (event->fp_valid) {
+		event->result = avflt_fp_find(event);
+		if (event->result) {
+			atomic_long_inc(&avflt_cache_hits);
+			event->fp_valid = 0;
+			avflt_update_cache(event);
+			rv = event->result;
+			goto exit;
+		}
+	}
+
+	atomic_long_inc(&avflt_cache_misses);
+
+	rv = avflt_queue_request(event);
+	if (rv) {
+		if (rv > 0)
+			rv = 0;
 		goto exit;
+	}
 
-	rv = avflt_wait_for_reply(event);
-	if (rv)
+	rv = avflt_wait_for_verdict(event);
+	if (rv) {
+		if (rv > 0)
+			rv = 0;
 		goto exit;
+	}
 
 	avflt_update_cache(event);
 	rv = event->result;
@@ -286,7 +702,7 @@ int avflt_get_file(struct avflt_event *event)
 
 void avflt_put_file(struct avflt_event *event)
 {
-	if (event->fd > 0) 
+	if (event->fd >= 0) 
 		put_unused_fd(event->fd);
 
 	if (event->file) 
@@ -296,19 +712,30 @@ void avflt_put_file(struct avflt_event *event)
 	event->file = NULL;
 }
 
+/*
+ * The file and the fd now belong to the scanner's fd table. The event can be
+ * dispatched again (re-queue, retry), so it must not refer to them anymore.
+ */
 void avflt_install_fd(struct avflt_event *event)
 {
 	fd_install(event->fd, event->file);
+	event->fd = -1;
+	event->file = NULL;
 }
 
 ssize_t avflt_copy_cmd(char __user *buf, size_t size, struct avflt_event *event)
 {
-	char cmd[256];
+	char cmd[AVFLT_CMD_SIZE];
 	int len;
 
-	len = snprintf(cmd, 256, "id:%d,type:%d,fd:%d,pid:%d,tgid:%d",
+	/*
+	 * v0: id:%d,type:%d,fd:%d,pid:%d,tgid:%d
+	 * v1: id:%d,type:%d,fd:%d,pid:%d,tgid:%d,limit:%lld
+	 */
+	len = snprintf(cmd, AVFLT_CMD_SIZE,
+			"id:%d,type:%d,fd:%d,pid:%d,tgid:%d,limit:%lld",
 			event->id, event->type, event->fd, event->pid,
-			event->tgid);
+			event->tgid, (long long)event->limit);
 	if (len < 0)
 		return len;
 
@@ -323,31 +750,75 @@ ssize_t avflt_copy_cmd(char __user *buf, size_t size, struct avflt_event *event)
 	return len;
 }
 
-int avflt_add_reply(struct avflt_event *event)
+int avflt_add_reply(struct avflt_proc *proc, struct avflt_event *event)
 {
-	struct avflt_proc *proc;
-
-	proc = avflt_proc_find(current->tgid);
-	if (!proc)
-		return -ENOENT;
-
 	avflt_proc_add_event(proc, event);
-	avflt_proc_put(proc);
 
 	return 0;
 }
 
-int avflt_request_empty(void)
+/*
+ * Threads of a scanner share one avflt_proc, each of them gets its own share
+ * of the pending requests, so a pool of workers reading one connection takes
+ * a burst in parallel instead of one worker taking it all.
+ */
+static int avflt_proc_threads(void)
 {
-	int rv;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,35)
+	return atomic_read(&current->signal->count);
+#else
+	return get_nr_threads(current);
+#endif
+}
+
+/*
+ * Returns how many requests the scanner thread may take with one read. It
+ * gets at most its share of the pending requests, so one greedy scanner or
+ * thread does not take them all from the others, and never more than the
+ * scanner's in-flight quota.
+ */
+int avflt_proc_budget(struct avflt_proc *proc)
+{
+	int quota;
+	int readers;
+	int budget;
+
+	readers = avflt_proc_count() * avflt_proc_threads();
 
 	spin_lock(&avflt_request_lock);
+	budget = avflt_request_count;
+	spin_unlock(&avflt_request_lock);
 
-	if (list_empty(&avflt_request_list))
-		rv = 1;
-	else
-		rv = 0;
+	if (readers > 1)
+		budget = DIV_ROUND_UP(budget, readers);
 
+	if (!budget)
+		budget = 1;
+
+	quota = atomic_read(&avflt_proc_quota);
+	if (!quota)
+		return budget;
+
+	spin_lock(&proc->lock);
+	budget = min(budget, quota - proc->inflight);
+	spin_unlock(&proc->lock);
+
+	return budget;
+}
+
+/*
+ * True if there is a request the scanner may take, the same test as in
+ * avflt_get_request(), so poll does not report requests held back from it.
+ */
+int avflt_request_available(struct avflt_proc *proc)
+{
+	pid_t excl;
+	int rv;
+
+	excl = avflt_proc_excl(proc);
+
+	spin_lock(&avflt_request_lock);
+	rv = avflt_select_event(excl) != NULL;
 	spin_unlock(&avflt_request_lock);
 
 	return rv;
@@ -384,6 +855,7 @@ void avflt_rem_requests(void)
 	LIST_HEAD(list);
 	struct avflt_event *event;
 	struct avflt_event *tmp;
+	int i;
 
 	spin_lock(&avflt_request_lock);
 
@@ -393,11 +865,18 @@ void avflt_rem_requests(void)
 
 	}
 
-	list_for_each_entry_safe(event, tmp, &avflt_request_list, req_list) {
-		list_move_tail(&event->req_list, &list);
-		avflt_event_done(event);
+	for (i = 0; i < AVFLT_PRIO_CLASSES; i++) {
+		list_for_each_entry_safe(event, tmp,
+				&avflt_request_queues[i].list, req_list) {
+			list_move_tail(&event->req_list, &list);
+			avflt_request_queues[i].depth--;
+			avflt_request_count--;
+			avflt_event_done(event);
+		}
 	}
 
+	wake_up_interruptible(&avflt_request_space);
+
 	spin_unlock(&avflt_request_lock);
 
 	list_for_each_entry_safe(event, tmp, &list, req_list) {
@@ -406,28 +885,84 @@ void avflt_rem_requests(void)
 	}
 }
 
-struct avflt_event *avflt_get_reply(const char __user *buf, size_t size)
+/*
+ * Heartbeat from a scanner still working on the event. The reply timeout is
+ * extended by ext msecs, but at most by the reply timeout itself, 0 extends
+ * it by the reply timeout.
+ */
+static struct avflt_event *avflt_get_heartbeat(int id, int ext)
+{
+	struct avflt_proc *proc;
+	int timeout;
+	int rv;
+
+	if (ext < 0)
+		return ERR_PTR(-EINVAL);
+
+	timeout = atomic_read(&avflt_reply_timeout);
+	if (!ext || ext > timeout)
+		ext = timeout;
+
+	proc = avflt_proc_find(current->tgid);
+	if (!proc)
+		return ERR_PTR(-ENOENT);
+
+	rv = avflt_proc_extend_event(proc, id, jiffies + msecs_to_jiffies(ext));
+	avflt_proc_put(proc);
+	if (rv)
+		return ERR_PTR(rv);
+
+	return NULL;
+}
+
+/*
+ * Parses the first reply in buf. Replies may be written in batches separated
+ * by the terminating zero, so the length of the parsed reply is returned in
+ * used. It is 0 when the next reply cannot be found. NULL is returned for a
+ * heartbeat reply, which does not complete the event.
+ */
+struct avflt_event *avflt_get_reply(const char __user *buf, size_t size,
+		size_t *used)
 {
 	struct avflt_proc *proc;
 	struct avflt_event *event;
-	char cmd[256];
+	char cmd[AVFLT_CMD_SIZE + 1];
+	size_t len;
 	int id;
 	int result;
 	int cache;
+	int ext;
 	int rv;
 
-	if (size > 256)
-		return ERR_PTR(-EINVAL);
+	*used = 0;
+	len = min_t(size_t, size, AVFLT_CMD_SIZE);
 
-	if (copy_from_user(cmd, buf, size))
+	if (copy_from_user(cmd, buf, len))
 		return ERR_PTR(-EFAULT);
 
+	cmd[len] = 0;
+	len = strnlen(cmd, len) + 1;
+
+	if (len > size) {
+		len = size;
+
+	} else if (len > AVFLT_CMD_SIZE)
+		return ERR_PTR(-EINVAL);
+
+	*used = len;
+
+	/*
+	 * v2: id:%d,ext:%d
+	 */
+	if (sscanf(cmd, "id:%d,ext:%d", &id, &ext) == 2)
+		return avflt_get_heartbeat(id, ext);
+
 	cache = -1;
 	/*
 	 * v0: id:%d,res:%d
 	 * v1: id:%d,res:%d,cache:%d
 	 */
-	rv = sscanf(buf, "id:%d,res:%d,cache:%d", &id, &result, &cache);
+	rv = sscanf(cmd, "id:%d,res:%d,cache:%d", &id, &result, &cache);
 	if (rv != 2 && rv != 3)
 		return ERR_PTR(-EINVAL);
 
@@ -448,6 +983,92 @@ struct avflt_event *avflt_get_reply(const char __user *buf, size_t size)
 	return event;
 }
 
+ssize_t avflt_queue_get_info(char *buf, int size)
+{
+	struct avflt_queue *queue;
+	ssize_t len = 0;
+	int i;
+	int j;
+
+	spin_lock(&avflt_request_lock);
+
+	/* <class>:<depth>:<dispatched>:<wait total>:<wait max>:<wait hist> */
+	for (i = 0; i < AVFLT_PRIO_CLASSES; i++) {
+		queue = &avflt_request_queues[i];
+		len += snprintf(buf + len, size - len, "%d:%d:%lu:%llu:%u", i,
+				queue->depth, queue->dispatched,
+				(unsigned long long)queue->wait_total,
+				queue->wait_max);
+
+		for (j = 0; j < AVFLT_WAIT_BUCKETS && len < size; j++)
+			len += snprintf(buf + len, size - len, "%c%lu",
+					j ? ',' : ':', queue->wait_hist[j]);
+
+		len++;
+		if (len >= size) {
+			len = size;
+			break;
+		}
+	}
+
+	spin_unlock(&avflt_request_lock);
+
+	return len;
+}
+
+ssize_t avflt_overload_get_info(char *buf, int size)
+{
+	ssize_t len;
+
+	spin_lock(&avflt_request_lock);
+	len = snprintf(buf, size, "hwm:%d,blocked:%lu,allowed:%lu,denied:%lu",
+			avflt_request_hwm, avflt_overload_blocked,
+			avflt_overload_allowed, avflt_overload_denied);
+	spin_unlock(&avflt_request_lock);
+
+	return len;
+}
+
+ssize_t avflt_cache_stats_get_info(char *buf, int size)
+{
+	return snprintf(buf, size, "hits:%ld,misses:%ld",
+			atomic_long_read(&avflt_cache_hits),
+			atomic_long_read(&avflt_cache_misses));
+}
+
+ssize_t avflt_load_get_info(char *buf, int size)
+{
+	struct avflt_event *event;
+	unsigned long oldest = 0;
+	unsigned int rate;
+	ssize_t len;
+	int i;
+
+	spin_lock(&avflt_request_lock);
+
+	for (i = 0; i < AVFLT_PRIO_CLASSES; i++) {
+		if (list_empty(&avflt_request_queues[i].list))
+			continue;
+
+		event = list_entry(avflt_request_queues[i].list.next,
+				struct avflt_event, req_list);
+
+		if (jiffies - event->queued > oldest)
+			oldest = jiffies - event->queued;
+	}
+
+	rate = avflt_arrival_rate;
+	if (jiffies - avflt_arrivals_start >= 2 * HZ)
+		rate = 0;
+
+	len = snprintf(buf, size, "depth:%d,oldest:%u,rate:%u",
+			avflt_request_count, jiffies_to_msecs(oldest), rate);
+
+	spin_unlock(&avflt_request_lock);
+
+	return len;
+}
+
 void avflt_invalidate_cache_root(redirfs_root root)
 {
 	struct avflt_root_data *data;
@@ -465,26 +1086,16 @@ void avflt_invalidate_cache_root(redirfs_root root)
 
 void avflt_invalidate_cache(void)
 {
-	redirfs_path *paths;
-	redirfs_root root;
-	int i = 0;
-
-	paths = redirfs_get_paths(avflt);
-	if (IS_ERR(paths))
-		return;
-
-	while (paths[i]) {
-		root = redirfs_get_root_path(paths[i]);
-		avflt_invalidate_cache_root(root);
-		redirfs_put_root(root);
-		i++;
-	}
-
-	redirfs_put_paths(paths);
+	atomic_inc(&avflt_cache_ver);
 }
 
 int avflt_check_init(void)
 {
+	int i;
+
+	for (i = 0; i < AVFLT_PRIO_CLASSES; i++)
+		INIT_LIST_HEAD(&avflt_request_queues[i].list);
+
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,22)
 	avflt_event_cache = kmem_cache_create("avflt_event_cache",
 			sizeof(struct avflt_event),
@@ -50,6 +50,9 @@ static struct avflt_root_data *avflt_root_data_alloc(void)
 
 	atomic_set(&data->cache_enabled, 1);
 	atomic_set(&data->cache_ver, 0);
+	spin_lock_init(&data->lock);
+	data->policy = AVFLT_POLICY_CHECK;
+	data->timeout_policy = AVFLT_TIMEOUT_GLOBAL;
 
 	return data;
 }
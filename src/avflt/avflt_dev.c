@@ -59,8 +59,11 @@ static int avflt_dev_open(struct inode *inode, struct file *file)
 static int avflt_dev_release_registered(struct inode *inode, struct file *file)
 {
 	avflt_proc_rem(current->tgid);
-	if (!avflt_proc_empty())
+	if (!avflt_proc_empty()) {
+		/* events held back from the last scanner left are its now */
+		wake_up_interruptible(&avflt_request_available);
 		return 0;
+	}
 
 	avflt_stop_accept();
 	avflt_rem_requests();
@@ -81,17 +84,14 @@ static int avflt_dev_release(struct inode *inode, struct file *file)
 	return avflt_dev_release_trusted(inode, file);
 }
 
-static ssize_t avflt_dev_read(struct file *file, char __user *buf,
-		size_t size, loff_t *pos)
+static ssize_t avflt_dev_read_event(struct avflt_proc *proc,
+		char __user *buf, size_t size)
 {
 	struct avflt_event *event;
 	ssize_t len;
 	ssize_t rv;
 
-	if (!(file->f_mode & FMODE_WRITE))
-		return -EINVAL;
-
-	event = avflt_get_request();
+	event = avflt_get_request(proc);
 	if (!event)
 		return 0;
 
@@ -103,7 +103,7 @@ static ssize_t avflt_dev_read(struct file *file, char __user *buf,
 	if (rv < 0)
 		goto error;
 
-	rv = avflt_add_reply(event);
+	rv = avflt_add_reply(proc, event);
 	if (rv)
 		goto error;
 
@@ -117,20 +117,102 @@ error:
 	return rv;
 }
 
+/*
+ * One read returns as many requests as there are available, as fit into the
+ * buffer and as the scanner's budget allows. Requests are separated by the
+ * terminating zero. A buffer smaller than two AVFLT_CMD_SIZE always gets just
+ * one request.
+ */
+static ssize_t avflt_dev_read(struct file *file, char __user *buf,
+		size_t size, loff_t *pos)
+{
+	struct avflt_proc *proc;
+	ssize_t len = 0;
+	ssize_t rv = 0;
+	int budget;
+
+	if (!(file->f_mode & FMODE_WRITE))
+		return -EINVAL;
+
+	proc = avflt_proc_find(current->tgid);
+	if (!proc)
+		return -ENOENT;
+
+	budget = avflt_proc_budget(proc);
+
+	while (budget-- > 0) {
+		rv = avflt_dev_read_event(proc, buf + len, size - len);
+		if (rv <= 0)
+			break;
+
+		len += rv;
+
+		if (size - len < AVFLT_CMD_SIZE)
+			break;
+	}
+
+	avflt_proc_put(proc);
+
+	if (len)
+		return len;
+
+	return rv;
+}
+
+/*
+ * Replies may be written in batches separated by the terminating zero. All
+ * replies are processed and the first error, if any, is returned.
+ */
 static ssize_t avflt_dev_write(struct file *file, const char __user *buf,
 		size_t size, loff_t *pos)
 {
 	struct avflt_event *event;
+	size_t len = 0;
+	size_t used;
+	ssize_t rv = 0;
+
+	while (len < size) {
+		event = avflt_get_reply(buf + len, size - len, &used);
+		if (IS_ERR(event)) {
+			if (!used)
+				return PTR_ERR(event);
+
+			if (!rv)
+				rv = PTR_ERR(event);
+		} else if (event) {
+			avflt_event_done(event);
+			avflt_event_put(event);
+		}
+
+		len += used;
+	}
 
-	event = avflt_get_reply(buf, size);
-	if (IS_ERR(event))
-		return PTR_ERR(event);
+	/* scanners over their quota wait in poll for a reply to be done */
+	if (atomic_read(&avflt_proc_quota))
+		wake_up_interruptible(&avflt_request_available);
+
+	if (rv)
+		return rv;
 
-	avflt_event_done(event);
-	avflt_event_put(event);
 	return size;
 }
 
+static int avflt_dev_may_read(void)
+{
+	struct avflt_proc *proc;
+	int rv;
+
+	proc = avflt_proc_find(current->tgid);
+
+	rv = avflt_request_available(proc);
+	if (rv && proc)
+		rv = avflt_proc_budget(proc) > 0;
+
+	avflt_proc_put(proc);
+
+	return rv;
+}
+
 static unsigned int avflt_poll(struct file *file, poll_table *wait)
 {
 	unsigned int mask;
@@ -139,7 +221,7 @@ static unsigned int avflt_poll(struct file *file, poll_table *wait)
 
 	mask = POLLOUT | POLLWRNORM;
 
-	if (!avflt_request_empty())
+	if (avflt_dev_may_read())
 		mask |= POLLIN | POLLRDNORM;
 
 	return mask;
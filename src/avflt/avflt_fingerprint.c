@@ -0,0 +1,299 @@
+/*
+ * AVFlt: Anti-Virus Filter
+ * Written by Frantisek Hrbata <frantisek.hrbata@redirfs.org>
+ *
+ * Copyright 2008 - 2010 Frantisek Hrbata
+ * All rights reserved.
+ *
+ * This file is part of RedirFS.
+ *
+ * RedirFS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * RedirFS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with RedirFS. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <crypto/hash.h>
+#include "avflt.h"
+
+#define AVFLT_FP_HASH_BITS	8
+#define AVFLT_FP_HASH_SIZE	(1 << AVFLT_FP_HASH_BITS)
+#define AVFLT_FP_MAX		4096
+
+struct avflt_fp_entry {
+	struct list_head hash;
+	struct list_head lru;
+	struct avflt_fingerprint fp;
+	struct avflt_root_data *root_data;
+	int global_cache_ver;
+	int root_cache_ver;
+	int state;
+};
+
+/*
+ * Tasks computing a fingerprint open the file once more. Such opens and the
+ * corresponding closes must not be checked again.
+ */
+struct avflt_fp_task {
+	struct list_head list;
+	struct task_struct *task;
+};
+
+atomic_t avflt_fp_size_max = ATOMIC_INIT(0);
+static struct crypto_shash *avflt_fp_tfm = NULL;
+static struct list_head avflt_fp_hash[AVFLT_FP_HASH_SIZE];
+static LIST_HEAD(avflt_fp_lru);
+static int avflt_fp_count = 0;
+static DEFINE_SPINLOCK(avflt_fp_lock);
+static LIST_HEAD(avflt_fp_tasks);
+static DEFINE_SPINLOCK(avflt_fp_tasks_lock);
+static atomic_t avflt_fp_busy = ATOMIC_INIT(0);
+
+static struct list_head *avflt_fp_bucket(struct avflt_fingerprint *fp)
+{
+	return &avflt_fp_hash[*(u32 *)fp->digest & (AVFLT_FP_HASH_SIZE - 1)];
+}
+
+static void avflt_fp_task_add(struct avflt_fp_task *fp_task)
+{
+	fp_task->task = current;
+	spin_lock(&avflt_fp_tasks_lock);
+	list_add(&fp_task->list, &avflt_fp_tasks);
+	atomic_inc(&avflt_fp_busy);
+	spin_unlock(&avflt_fp_tasks_lock);
+}
+
+static void avflt_fp_task_rem(struct avflt_fp_task *fp_task)
+{
+	spin_lock(&avflt_fp_tasks_lock);
+	list_del(&fp_task->list);
+	atomic_dec(&avflt_fp_busy);
+	spin_unlock(&avflt_fp_tasks_lock);
+}
+
+int avflt_fp_self(void)
+{
+	struct avflt_fp_task *fp_task;
+	int found = 0;
+
+	if (!atomic_read(&avflt_fp_busy))
+		return 0;
+
+	spin_lock(&avflt_fp_tasks_lock);
+
+	list_for_each_entry(fp_task, &avflt_fp_tasks, list) {
+		if (fp_task->task == current) {
+			found = 1;
+			break;
+		}
+	}
+
+	spin_unlock(&avflt_fp_tasks_lock);
+
+	return found;
+}
+
+int avflt_fp_compute(struct file *file, struct avflt_fingerprint *fp)
+{
+	struct avflt_fp_task fp_task;
+	struct shash_desc *desc;
+	struct file *fp_file;
+	loff_t pos = 0;
+	char *buf;
+	int rv;
+
+	desc = kmalloc(sizeof(struct shash_desc) +
+			crypto_shash_descsize(avflt_fp_tfm), GFP_KERNEL);
+	if (!desc)
+		return -ENOMEM;
+
+	buf = (char *)__get_free_page(GFP_KERNEL);
+	if (!buf) {
+		kfree(desc);
+		return -ENOMEM;
+	}
+
+	desc->tfm = avflt_fp_tfm;
+	desc->flags = 0;
+
+	avflt_fp_task_add(&fp_task);
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,29)
+	fp_file = dentry_open(dget(file->f_dentry), mntget(file->f_vfsmnt),
+			O_RDONLY | O_LARGEFILE);
+#else
+	fp_file = dentry_open(dget(file->f_dentry), mntget(file->f_vfsmnt),
+			O_RDONLY | O_LARGEFILE, current_cred());
+#endif
+	if (IS_ERR(fp_file)) {
+		rv = PTR_ERR(fp_file);
+		goto exit;
+	}
+
+	rv = crypto_shash_init(desc);
+	while (!rv) {
+		rv = kernel_read(fp_file, pos, buf, PAGE_SIZE);
+		if (rv <= 0)
+			break;
+
+		pos += rv;
+		rv = crypto_shash_update(desc, buf, rv);
+	}
+
+	if (!rv)
+		rv = crypto_shash_final(desc, fp->digest);
+
+	fp->size = pos;
+	fput(fp_file);
+exit:
+	avflt_fp_task_rem(&fp_task);
+	free_page((unsigned long)buf);
+	kfree(desc);
+	return rv;
+}
+
+/*
+ * Verdicts are shared only within one root, so the root's cache settings and
+ * its cache invalidation apply to them.
+ */
+static struct avflt_fp_entry *avflt_fp_find_nolock(
+		struct avflt_fingerprint *fp, struct avflt_root_data *root_data)
+{
+	struct avflt_fp_entry *entry;
+
+	list_for_each_entry(entry, avflt_fp_bucket(fp), hash) {
+		if (entry->root_data != root_data)
+			continue;
+
+		if (entry->fp.size != fp->size)
+			continue;
+
+		if (!memcmp(entry->fp.digest, fp->digest, AVFLT_DIGEST_SIZE))
+			return entry;
+	}
+
+	return NULL;
+}
+
+static void avflt_fp_rem_nolock(struct avflt_fp_entry *entry)
+{
+	list_del(&entry->hash);
+	list_del(&entry->lru);
+	avflt_fp_count--;
+	avflt_put_root_data(entry->root_data);
+	kfree(entry);
+}
+
+int avflt_fp_find(struct avflt_event *event)
+{
+	struct avflt_root_data *root_data = event->root_data;
+	struct avflt_fp_entry *entry;
+	int state = 0;
+
+	if (!root_data)
+		return 0;
+
+	spin_lock(&avflt_fp_lock);
+
+	entry = avflt_fp_find_nolock(&event->fp, root_data);
+	if (!entry)
+		goto exit;
+
+	if (entry->global_cache_ver != atomic_read(&avflt_cache_ver) ||
+	    entry->root_cache_ver != atomic_read(&root_data->cache_ver)) {
+		avflt_fp_rem_nolock(entry);
+		goto exit;
+	}
+
+	list_move_tail(&entry->lru, &avflt_fp_lru);
+	state = entry->state;
+exit:
+	spin_unlock(&avflt_fp_lock);
+	return state;
+}
+
+void avflt_fp_add(struct avflt_event *event)
+{
+	struct avflt_fp_entry *entry;
+	struct avflt_fp_entry *found;
+
+	if (!event->root_data)
+		return;
+
+	entry = kmalloc(sizeof(struct avflt_fp_entry), GFP_KERNEL);
+	if (!entry)
+		return;
+
+	memcpy(&entry->fp, &event->fp, sizeof(struct avflt_fingerprint));
+	entry->root_data = avflt_get_root_data(event->root_data);
+	entry->global_cache_ver = event->global_cache_ver;
+	entry->root_cache_ver = event->root_cache_ver;
+	entry->state = event->result;
+
+	spin_lock(&avflt_fp_lock);
+
+	found = avflt_fp_find_nolock(&event->fp, event->root_data);
+	if (found)
+		avflt_fp_rem_nolock(found);
+
+	if (avflt_fp_count == AVFLT_FP_MAX)
+		avflt_fp_rem_nolock(list_entry(avflt_fp_lru.next,
+					struct avflt_fp_entry, lru));
+
+	list_add(&entry->hash, avflt_fp_bucket(&event->fp));
+	list_add_tail(&entry->lru, &avflt_fp_lru);
+	avflt_fp_count++;
+
+	spin_unlock(&avflt_fp_lock);
+}
+
+void avflt_fp_flush(void)
+{
+	struct avflt_fp_entry *entry;
+	struct avflt_fp_entry *tmp;
+
+	spin_lock(&avflt_fp_lock);
+
+	list_for_each_entry_safe(entry, tmp, &avflt_fp_lru, lru) {
+		avflt_fp_rem_nolock(entry);
+	}
+
+	spin_unlock(&avflt_fp_lock);
+}
+
+int avflt_fp_available(void)
+{
+	return avflt_fp_tfm != NULL;
+}
+
+void avflt_fp_init(void)
+{
+	int i;
+
+	for (i = 0; i < AVFLT_FP_HASH_SIZE; i++)
+		INIT_LIST_HEAD(&avflt_fp_hash[i]);
+
+	avflt_fp_tfm = crypto_alloc_shash("sha256", 0, 0);
+	if (IS_ERR(avflt_fp_tfm)) {
+		printk(KERN_WARNING "avflt: sha256 not available, "
+				"fingerprints disabled\n");
+		avflt_fp_tfm = NULL;
+	}
+}
+
+void avflt_fp_exit(void)
+{
+	avflt_fp_flush();
+
+	if (avflt_fp_tfm)
+		crypto_free_shash(avflt_fp_tfm);
+}
+
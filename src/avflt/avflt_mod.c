@@ -27,9 +27,12 @@ static int __init avflt_init(void)
 {
 	int rv;
 
+	avflt_proc_init();
+	avflt_fp_init();
+
 	rv = avflt_check_init();
 	if (rv)
-		return rv;
+		goto err_fp;
 
 	rv = avflt_data_init();
 	if (rv)
@@ -59,6 +62,8 @@ err_data:
 	avflt_data_exit();
 err_check:
 	avflt_check_exit();
+err_fp:
+	avflt_fp_exit();
 	return rv;
 }
 
@@ -69,6 +74,7 @@ static void __exit avflt_exit(void)
 	avflt_rfs_exit();
 	avflt_data_exit();
 	avflt_check_exit();
+	avflt_fp_exit();
 }
 
 module_init(avflt_init);
@@ -23,12 +23,26 @@
 
 #include "avflt.h"
 
+/*
+ * Registered and trusted processes are kept in a list for the sysfs interface
+ * and in a tgid hash for lookups. The hash is modified under the list lock and
+ * it is read under rcu, so avflt_proc_allow and avflt_trusted_allow called for
+ * each open and close do not take any lock.
+ */
 static LIST_HEAD(avflt_proc_list);
+static struct list_head avflt_proc_hash[AVFLT_TGID_HASH_SIZE];
 static DEFINE_SPINLOCK(avflt_proc_lock);
+static int avflt_proc_nr = 0;
 
 static LIST_HEAD(avflt_trusted_list);
+static struct list_head avflt_trusted_hash[AVFLT_TGID_HASH_SIZE];
 static DEFINE_SPINLOCK(avflt_trusted_lock);
 
+static struct list_head *avflt_tgid_bucket(struct list_head *hash, pid_t tgid)
+{
+	return &hash[hash_long((unsigned long)tgid, AVFLT_TGID_HASH_BITS)];
+}
+
 static struct avflt_trusted *avflt_trusted_alloc(pid_t tgid)
 {
 	struct avflt_trusted *trusted;
@@ -37,6 +51,8 @@ static struct avflt_trusted *avflt_trusted_alloc(pid_t tgid)
 	if (!trusted)
 		return ERR_PTR(-ENOMEM);
 
+	INIT_LIST_HEAD(&trusted->list);
+	INIT_LIST_HEAD(&trusted->hash);
 	trusted->tgid = tgid;
 	trusted->open = 1;
 
@@ -51,8 +67,11 @@ static void avflt_trusted_free(struct avflt_trusted *trusted)
 static struct avflt_trusted *avflt_trusted_find(pid_t tgid)
 {
 	struct avflt_trusted *trusted;
+	struct list_head *bucket;
 
-	list_for_each_entry(trusted, &avflt_trusted_list, list) {
+	bucket = avflt_tgid_bucket(avflt_trusted_hash, tgid);
+
+	list_for_each_entry_rcu(trusted, bucket, hash) {
 		if (trusted->tgid == tgid)
 			return trusted;
 	}
@@ -76,8 +95,11 @@ int avflt_trusted_add(pid_t tgid)
 		found->open++;
 		avflt_trusted_free(trusted);
 
-	} else
+	} else {
 		list_add_tail(&trusted->list, &avflt_trusted_list);
+		list_add_rcu(&trusted->hash,
+				avflt_tgid_bucket(avflt_trusted_hash, tgid));
+	}
 
 	spin_unlock(&avflt_trusted_lock);
 
@@ -91,26 +113,27 @@ void avflt_trusted_rem(pid_t tgid)
 	spin_lock(&avflt_trusted_lock);
 
 	found = avflt_trusted_find(tgid);
-	if (!found)
-		goto exit;
-
-	if (--found->open)
-		goto exit;
+	if (!found || --found->open) {
+		spin_unlock(&avflt_trusted_lock);
+		return;
+	}
 
 	list_del_init(&found->list);
+	list_del_rcu(&found->hash);
 
-	avflt_trusted_free(found);
-exit:
 	spin_unlock(&avflt_trusted_lock);
+
+	synchronize_rcu();
+	avflt_trusted_free(found);
 }
 
 int avflt_trusted_allow(pid_t tgid)
 {
 	struct avflt_trusted *found;
 
-	spin_lock(&avflt_trusted_lock);
+	rcu_read_lock();
 	found = avflt_trusted_find(tgid);
-	spin_unlock(&avflt_trusted_lock);
+	rcu_read_unlock();
 
 	if (found)
 		return 1;
@@ -118,16 +141,26 @@ int avflt_trusted_allow(pid_t tgid)
 	return 0;
 }
 
+static struct list_head *avflt_proc_event_bucket(struct avflt_proc *proc,
+		int id)
+{
+	/* event ids are sequential, so the low bits spread them evenly */
+	return &proc->events[id & (AVFLT_EVENT_HASH_SIZE - 1)];
+}
+
 static struct avflt_proc *avflt_proc_alloc(pid_t tgid)
 {
 	struct avflt_proc *proc;
+	int i;
 
 	proc = kzalloc(sizeof(struct avflt_proc), GFP_KERNEL);
 	if (!proc)
 		return ERR_PTR(-ENOMEM);
 
 	INIT_LIST_HEAD(&proc->list);
-	INIT_LIST_HEAD(&proc->events);
+	INIT_LIST_HEAD(&proc->hash);
+	for (i = 0; i < AVFLT_EVENT_HASH_SIZE; i++)
+		INIT_LIST_HEAD(&proc->events[i]);
 	spin_lock_init(&proc->lock);
 	atomic_set(&proc->count, 1);
 	proc->tgid = tgid;
@@ -151,6 +184,7 @@ void avflt_proc_put(struct avflt_proc *proc)
 {
 	struct avflt_event *event;
 	struct avflt_event *tmp;
+	int i;
 
 	if (!proc || IS_ERR(proc))
 		return;
@@ -159,28 +193,37 @@ void avflt_proc_put(struct avflt_proc *proc)
 	if (!atomic_dec_and_test(&proc->count))
 		return;
 
-	list_for_each_entry_safe(event, tmp, &proc->events, proc_list) {
-		list_del_init(&event->proc_list);
-		avflt_readd_request(event);
-		avflt_event_put(event);
+	for (i = 0; i < AVFLT_EVENT_HASH_SIZE; i++) {
+		list_for_each_entry_safe(event, tmp, &proc->events[i],
+				proc_list) {
+			list_del_init(&event->proc_list);
+			event->owner = 0;
+			avflt_readd_request(event);
+			avflt_event_put(event);
+		}
 	}
 
 	kfree(proc);
 }
 
-static struct avflt_proc *avflt_proc_find_nolock(pid_t tgid)
+static struct avflt_proc *avflt_proc_lookup(pid_t tgid)
 {
-	struct avflt_proc *found = NULL;
+	struct list_head *bucket;
 	struct avflt_proc *proc;
 
-	list_for_each_entry(proc, &avflt_proc_list, list) {
-		if (proc->tgid == tgid) {
-			found = avflt_proc_get(proc);
-			break;
-		}
+	bucket = avflt_tgid_bucket(avflt_proc_hash, tgid);
+
+	list_for_each_entry_rcu(proc, bucket, hash) {
+		if (proc->tgid == tgid)
+			return proc;
 	}
 
-	return found;
+	return NULL;
+}
+
+static struct avflt_proc *avflt_proc_find_nolock(pid_t tgid)
+{
+	return avflt_proc_get(avflt_proc_lookup(tgid));
 }
 
 struct avflt_proc *avflt_proc_find(pid_t tgid)
@@ -214,6 +257,8 @@ struct avflt_proc *avflt_proc_add(pid_t tgid)
 	}
 
 	list_add_tail(&proc->list, &avflt_proc_list);
+	avflt_proc_nr++;
+	list_add_rcu(&proc->hash, avflt_tgid_bucket(avflt_proc_hash, tgid));
 	avflt_proc_get(proc);
 
 	spin_unlock(&avflt_proc_lock);
@@ -239,7 +284,10 @@ void avflt_proc_rem(pid_t tgid)
 	}
 
 	list_del(&proc->list);
+	list_del_rcu(&proc->hash);
+	avflt_proc_nr--;
 	spin_unlock(&avflt_proc_lock);
+	synchronize_rcu();
 	avflt_proc_put(proc);
 	avflt_proc_put(proc);
 }
@@ -248,15 +296,26 @@ int avflt_proc_allow(pid_t tgid)
 {
 	struct avflt_proc *proc;
 
-	proc = avflt_proc_find(tgid);
-	if (proc) {
-		avflt_proc_put(proc);
+	rcu_read_lock();
+	proc = avflt_proc_lookup(tgid);
+	rcu_read_unlock();
+
+	if (proc)
 		return 1;
-	}
 
 	return 0;
 }
 
+void avflt_proc_init(void)
+{
+	int i;
+
+	for (i = 0; i < AVFLT_TGID_HASH_SIZE; i++) {
+		INIT_LIST_HEAD(&avflt_proc_hash[i]);
+		INIT_LIST_HEAD(&avflt_trusted_hash[i]);
+	}
+}
+
 int avflt_proc_empty(void)
 {
 	int empty;
@@ -268,30 +327,53 @@ int avflt_proc_empty(void)
 	return empty;
 }
 
+int avflt_proc_count(void)
+{
+	int count;
+
+	spin_lock(&avflt_proc_lock);
+	count = avflt_proc_nr;
+	spin_unlock(&avflt_proc_lock);
+
+	return count;
+}
+
 void avflt_proc_add_event(struct avflt_proc *proc, struct avflt_event *event)
 {
 	spin_lock(&proc->lock);
 
-	list_add_tail(&event->proc_list, &proc->events);
+	list_add_tail(&event->proc_list,
+			avflt_proc_event_bucket(proc, event->id));
 	avflt_event_get(event);
+	event->owner = proc->tgid;
+	event->taken = jiffies;
+	proc->inflight++;
 
 	spin_unlock(&proc->lock);
 }
 
-void avflt_proc_rem_event(struct avflt_proc *proc, struct avflt_event *event)
+/*
+ * Returns 1 when the event was taken away from the process or 0 when the
+ * process does not hold it anymore.
+ */
+int avflt_proc_rem_event(struct avflt_proc *proc, struct avflt_event *event)
 {
 	spin_lock(&proc->lock);
 
-	if (list_empty(&event->proc_list)) {
+	if (list_empty(&event->proc_list) || event->owner != proc->tgid) {
 		spin_unlock(&proc->lock);
-		return;
+		return 0;
 	}
 
 	list_del_init(&event->proc_list);
+	event->owner = 0;
+	proc->inflight--;
 
 	spin_unlock(&proc->lock);
 
 	avflt_event_put(event);
+
+	return 1;
 }
 
 struct avflt_event *avflt_proc_get_event(struct avflt_proc *proc, int id)
@@ -301,21 +383,56 @@ struct avflt_event *avflt_proc_get_event(struct avflt_proc *proc, int id)
 
 	spin_lock(&proc->lock);
 
-	list_for_each_entry(event, &proc->events, proc_list) {
+	list_for_each_entry(event, avflt_proc_event_bucket(proc, id),
+			proc_list) {
 		if (event->id == id) {
 			found = event;
 			break;
 		}
 	}
 
-	if (found)
-		list_del_init(&event->proc_list);
+	if (found) {
+		list_del_init(&found->proc_list);
+		found->owner = 0;
+		proc->inflight--;
+	}
 
 	spin_unlock(&proc->lock);
 
 	return found;
 }
 
+/*
+ * The scanner is still working on the event. Its deadline is moved, so it is
+ * not given to another scanner, and the reply timeout is pushed out to
+ * expires.
+ */
+int avflt_proc_extend_event(struct avflt_proc *proc, int id,
+		unsigned long expires)
+{
+	struct avflt_event *event;
+	int rv = -ENOENT;
+
+	spin_lock(&proc->lock);
+
+	list_for_each_entry(event, avflt_proc_event_bucket(proc, id),
+			proc_list) {
+		if (event->id != id)
+			continue;
+
+		event->taken = jiffies;
+		if (time_before(event->expires, expires))
+			event->expires = expires;
+
+		rv = 0;
+		break;
+	}
+
+	spin_unlock(&proc->lock);
+
+	return rv;
+}
+
 ssize_t avflt_proc_get_info(char *buf, int size)
 {
 	struct avflt_proc *proc;
@@ -28,6 +28,9 @@ static int avflt_should_check(struct file *file)
 	if (avflt_is_stopped())
 		return 0;
 
+	if (avflt_fp_self())
+		return 0;
+
 	if (avflt_proc_allow(current->tgid))
 		return 0;
 
@@ -43,6 +46,74 @@ static int avflt_should_check(struct file *file)
 	return 1;
 }
 
+static int avflt_match_ext(const char *name, const char *exts)
+{
+	const char *ext;
+	const char *end;
+	size_t len;
+
+	ext = strrchr(name, '.');
+	if (!ext || ext == name)
+		return 0;
+
+	ext++;
+	len = strlen(ext);
+
+	while (*exts) {
+		end = strchr(exts, ',');
+		if (!end)
+			end = exts + strlen(exts);
+
+		if ((size_t)(end - exts) == len && !strnicmp(exts, ext, len))
+			return 1;
+
+		if (!*end)
+			break;
+
+		exts = end + 1;
+	}
+
+	return 0;
+}
+
+static int avflt_check_policy(struct file *file, loff_t *limit)
+{
+	struct dentry *dentry = file->f_dentry;
+	struct avflt_root_data *data;
+	loff_t size;
+	int rv = 1;
+
+	*limit = 0;
+
+	data = avflt_get_root_data_inode(dentry->d_inode);
+	if (!data)
+		return 1;
+
+	size = i_size_read(dentry->d_inode);
+
+	spin_lock(&data->lock);
+
+	if (data->policy_size && size > data->policy_size) {
+		if (data->policy == AVFLT_POLICY_SKIP)
+			rv = 0;
+
+		else if (data->policy == AVFLT_POLICY_HEAD)
+			*limit = data->policy_size;
+	}
+
+	if (rv && *data->policy_exts) {
+		spin_lock(&dentry->d_lock);
+		if (avflt_match_ext(dentry->d_name.name, data->policy_exts))
+			rv = 0;
+		spin_unlock(&dentry->d_lock);
+	}
+
+	spin_unlock(&data->lock);
+	avflt_put_root_data(data);
+
+	return rv;
+}
+
 static int avflt_check_cache(struct file *file, int type)
 {
 	struct avflt_root_data *root_data;
@@ -85,6 +156,9 @@ static int avflt_check_cache(struct file *file, int type)
 	if (inode_data->root_data != root_data)
 		goto exit;
 
+	if (inode_data->global_cache_ver != atomic_read(&avflt_cache_ver))
+		goto exit;
+
 	if (inode_data->root_cache_ver != atomic_read(&root_data->cache_ver))
 		goto exit;
 
@@ -99,6 +173,77 @@ exit:
 	return state;
 }
 
+/*
+ * Same as deny_write_access(), which is not exported. Writers are kept out
+ * while a fingerprinted file is hashed and scanned, so the verdict stored
+ * under the digest is for the content that was hashed.
+ */
+static int avflt_deny_write(struct inode *inode)
+{
+	int rv = 0;
+
+	spin_lock(&inode->i_lock);
+
+	if (atomic_read(&inode->i_writecount) > 0)
+		rv = -ETXTBSY;
+	else
+		atomic_dec(&inode->i_writecount);
+
+	spin_unlock(&inode->i_lock);
+
+	return rv;
+}
+
+static void avflt_allow_write(struct inode *inode)
+{
+	atomic_inc(&inode->i_writecount);
+}
+
+/*
+ * On success the write access to the file is denied, avflt_allow_write() has
+ * to be called when the verdict is known.
+ */
+static int avflt_check_fp(struct file *file, int type, loff_t limit,
+		struct avflt_fingerprint *fp)
+{
+	struct inode *inode = file->f_dentry->d_inode;
+	struct avflt_root_data *root_data;
+	int size_max;
+	int enabled;
+
+	size_max = atomic_read(&avflt_fp_size_max);
+	if (!size_max || limit)
+		return 0;
+
+	if (type != AVFLT_EVENT_OPEN || (file->f_mode & FMODE_WRITE))
+		return 0;
+
+	if (i_size_read(inode) > size_max)
+		return 0;
+
+	if (!atomic_read(&avflt_cache_enabled))
+		return 0;
+
+	root_data = avflt_get_root_data_inode(inode);
+	if (!root_data)
+		return 0;
+
+	enabled = atomic_read(&root_data->cache_enabled);
+	avflt_put_root_data(root_data);
+	if (!enabled)
+		return 0;
+
+	if (avflt_deny_write(inode))
+		return 0;
+
+	if (avflt_fp_compute(file, fp)) {
+		avflt_allow_write(inode);
+		return 0;
+	}
+
+	return 1;
+}
+
 static enum redirfs_rv avflt_eval_res(int rv, struct redirfs_args *args)
 {
 	if (rv < 0) {
@@ -117,16 +262,31 @@ static enum redirfs_rv avflt_eval_res(int rv, struct redirfs_args *args)
 static enum redirfs_rv avflt_check_file(struct file *file, int type,
 		struct redirfs_args *args)
 {
+	struct avflt_fingerprint *pfp = NULL;
+	struct avflt_fingerprint fp;
+	loff_t limit;
 	int rv;
 
 	if (!avflt_should_check(file))
 		return REDIRFS_CONTINUE;
 
+	if (!avflt_check_policy(file, &limit))
+		return REDIRFS_CONTINUE;
+
 	rv = avflt_check_cache(file, type);
-	if (rv)
+	if (rv) {
+		atomic_long_inc(&avflt_cache_hits);
 		return avflt_eval_res(rv, args);
+	}
+
+	if (avflt_check_fp(file, type, limit, &fp))
+		pfp = &fp;
+
+	rv = avflt_process_request(file, type, limit, pfp);
+
+	if (pfp)
+		avflt_allow_write(file->f_dentry->d_inode);
 
-	rv = avflt_process_request(file, type);
 	if (rv)
 		return avflt_eval_res(rv, args);
 
@@ -24,32 +24,212 @@
 #include "avflt.h"
 
 atomic_t avflt_reply_timeout = ATOMIC_INIT(0);
+atomic_t avflt_timeout_policy = ATOMIC_INIT(AVFLT_TIMEOUT_ERROR);
+atomic_t avflt_queue_limit = ATOMIC_INIT(0);
+atomic_t avflt_queue_policy = ATOMIC_INIT(AVFLT_OVERLOAD_BLOCK);
+atomic_t avflt_proc_quota = ATOMIC_INIT(0);
 atomic_t avflt_cache_enabled = ATOMIC_INIT(1);
 
+static char avflt_timeout_policy_char(int policy)
+{
+	switch (policy) {
+		case AVFLT_TIMEOUT_GLOBAL:
+			return 'g';
+
+		case AVFLT_TIMEOUT_ALLOW:
+			return 'a';
+
+		case AVFLT_TIMEOUT_DENY:
+			return 'd';
+
+		case AVFLT_TIMEOUT_RETRY:
+			return 'r';
+
+		default:
+			return 'e';
+	}
+}
+
+static int avflt_timeout_policy_parse(char policy)
+{
+	switch (policy) {
+		case 'g':
+			return AVFLT_TIMEOUT_GLOBAL;
+
+		case 'e':
+			return AVFLT_TIMEOUT_ERROR;
+
+		case 'a':
+			return AVFLT_TIMEOUT_ALLOW;
+
+		case 'd':
+			return AVFLT_TIMEOUT_DENY;
+
+		case 'r':
+			return AVFLT_TIMEOUT_RETRY;
+
+		default:
+			return -EINVAL;
+	}
+}
+
 static ssize_t avflt_timeout_show(redirfs_filter filter,
 		struct redirfs_filter_attribute *attr, char *buf)
 {
-	return snprintf(buf, PAGE_SIZE, "%d",
-			atomic_read(&avflt_reply_timeout));
+	return snprintf(buf, PAGE_SIZE, "%d:%c",
+			atomic_read(&avflt_reply_timeout),
+			avflt_timeout_policy_char(
+				atomic_read(&avflt_timeout_policy)));
 }
 
+/*
+ * <timeout>[:<policy>], timeout in msecs, 0 means wait forever and policy is
+ * applied when there is no reply in time
+ * e - fail the open or close with ETIMEDOUT
+ * a - allow access
+ * d - deny access
+ * r - give the request to another scanner, then fail as with e
+ */
 static ssize_t avflt_timeout_store(redirfs_filter filter,
 		struct redirfs_filter_attribute *attr, const char *buf,
 		size_t count)
 {
+	char policy = 0;
 	int timeout;
+	int rv;
 
-	if (sscanf(buf, "%d", &timeout) != 1)
+	rv = sscanf(buf, "%d:%c", &timeout, &policy);
+	if (rv != 1 && rv != 2)
 		return -EINVAL;
 
 	if (timeout < 0)
 		return -EINVAL;
 
+	if (policy) {
+		rv = avflt_timeout_policy_parse(policy);
+		if (rv < 0 || rv == AVFLT_TIMEOUT_GLOBAL)
+			return -EINVAL;
+
+		atomic_set(&avflt_timeout_policy, rv);
+	}
+
 	atomic_set(&avflt_reply_timeout, timeout);
 
 	return count;
 }
 
+static ssize_t avflt_queue_limit_show(redirfs_filter filter,
+		struct redirfs_filter_attribute *attr, char *buf)
+{
+	char policy;
+
+	switch (atomic_read(&avflt_queue_policy)) {
+		case AVFLT_OVERLOAD_ALLOW:
+			policy = 'a';
+			break;
+
+		case AVFLT_OVERLOAD_DENY:
+			policy = 'd';
+			break;
+
+		default:
+			policy = 'b';
+	}
+
+	return snprintf(buf, PAGE_SIZE, "%d:%c",
+			atomic_read(&avflt_queue_limit), policy);
+}
+
+/*
+ * <limit>[:<policy>], limit 0 means unlimited queue and policy is applied
+ * when the queue is full
+ * b - block the caller until there is a free slot
+ * a - allow access without check
+ * d - deny access
+ */
+static ssize_t avflt_queue_limit_store(redirfs_filter filter,
+		struct redirfs_filter_attribute *attr, const char *buf,
+		size_t count)
+{
+	char policy = 0;
+	int limit;
+	int rv;
+
+	rv = sscanf(buf, "%d:%c", &limit, &policy);
+	if (rv != 1 && rv != 2)
+		return -EINVAL;
+
+	if (limit < 0)
+		return -EINVAL;
+
+	switch (policy) {
+		case 0:
+			break;
+
+		case 'b':
+			atomic_set(&avflt_queue_policy, AVFLT_OVERLOAD_BLOCK);
+			break;
+
+		case 'a':
+			atomic_set(&avflt_queue_policy, AVFLT_OVERLOAD_ALLOW);
+			break;
+
+		case 'd':
+			atomic_set(&avflt_queue_policy, AVFLT_OVERLOAD_DENY);
+			break;
+
+		default:
+			return -EINVAL;
+	}
+
+	atomic_set(&avflt_queue_limit, limit);
+	wake_up_interruptible(&avflt_request_space);
+
+	return count;
+}
+
+static ssize_t avflt_cache_stats_show(redirfs_filter filter,
+		struct redirfs_filter_attribute *attr, char *buf)
+{
+	return avflt_cache_stats_get_info(buf, PAGE_SIZE);
+}
+
+static ssize_t avflt_overload_show(redirfs_filter filter,
+		struct redirfs_filter_attribute *attr, char *buf)
+{
+	return avflt_overload_get_info(buf, PAGE_SIZE);
+}
+
+static ssize_t avflt_quota_show(redirfs_filter filter,
+		struct redirfs_filter_attribute *attr, char *buf)
+{
+	return snprintf(buf, PAGE_SIZE, "%d", atomic_read(&avflt_proc_quota));
+}
+
+static ssize_t avflt_quota_store(redirfs_filter filter,
+		struct redirfs_filter_attribute *attr, const char *buf,
+		size_t count)
+{
+	int quota;
+
+	if (sscanf(buf, "%d", &quota) != 1)
+		return -EINVAL;
+
+	if (quota < 0)
+		return -EINVAL;
+
+	atomic_set(&avflt_proc_quota, quota);
+	wake_up_interruptible(&avflt_request_available);
+
+	return count;
+}
+
+static ssize_t avflt_load_show(redirfs_filter filter,
+		struct redirfs_filter_attribute *attr, char *buf)
+{
+	return avflt_load_get_info(buf, PAGE_SIZE);
+}
+
 static ssize_t avflt_cache_show(redirfs_filter filter,
 		struct redirfs_filter_attribute *attr, char *buf)
 {
@@ -93,6 +273,36 @@ static ssize_t avflt_cache_store(redirfs_filter filter,
 	return count;
 }
 
+static ssize_t avflt_fingerprint_show(redirfs_filter filter,
+		struct redirfs_filter_attribute *attr, char *buf)
+{
+	return snprintf(buf, PAGE_SIZE, "%d",
+			atomic_read(&avflt_fp_size_max));
+}
+
+static ssize_t avflt_fingerprint_store(redirfs_filter filter,
+		struct redirfs_filter_attribute *attr, const char *buf,
+		size_t count)
+{
+	int size_max;
+
+	if (sscanf(buf, "%d", &size_max) != 1)
+		return -EINVAL;
+
+	if (size_max < 0)
+		return -EINVAL;
+
+	if (size_max && !avflt_fp_available())
+		return -EOPNOTSUPP;
+
+	atomic_set(&avflt_fp_size_max, size_max);
+
+	if (!size_max)
+		avflt_fp_flush();
+
+	return count;
+}
+
 static ssize_t avflt_cache_paths_show(redirfs_filter filter,
 		struct redirfs_filter_attribute *attr, char *buf)
 {
@@ -137,30 +347,39 @@ next:
 	return size;
 }
 
-static ssize_t avflt_cache_paths_store(redirfs_filter filter,
-		struct redirfs_filter_attribute *attr, const char *buf,
-		size_t count)
+static struct avflt_root_data *avflt_get_root_data_id(int id)
 {
 	struct avflt_root_data *data;
 	redirfs_path path;
 	redirfs_root root;
-	char cache;
-	int id;
-
-	if (sscanf(buf, "%c:%d", &cache, &id) != 2)
-		return -EINVAL;
 
 	path = redirfs_get_path_id(id);
 	if (!path)
-		return -ENOENT;
+		return NULL;
 
 	root = redirfs_get_root_path(path);
 	redirfs_put_path(path);
 	if (!root)
-		return -ENOENT;
+		return NULL;
 
 	data = avflt_get_root_data_root(root);
 	redirfs_put_root(root);
+
+	return data;
+}
+
+static ssize_t avflt_cache_paths_store(redirfs_filter filter,
+		struct redirfs_filter_attribute *attr, const char *buf,
+		size_t count)
+{
+	struct avflt_root_data *data;
+	char cache;
+	int id;
+
+	if (sscanf(buf, "%c:%d", &cache, &id) != 2)
+		return -EINVAL;
+
+	data = avflt_get_root_data_id(id);
 	if (!data)
 		return -ENOENT;
 
@@ -187,6 +406,150 @@ static ssize_t avflt_cache_paths_store(redirfs_filter filter,
 	return count;
 }
 
+static ssize_t avflt_policy_paths_show(redirfs_filter filter,
+		struct redirfs_filter_attribute *attr, char *buf)
+{
+	struct avflt_root_data *data;
+	redirfs_path *paths;
+	redirfs_root root;
+	ssize_t size = 0;
+	char policy;
+	int i = 0;
+
+	paths = redirfs_get_paths(avflt);
+	if (IS_ERR(paths))
+		return PTR_ERR(paths);
+
+	while (paths[i]) {
+		root = redirfs_get_root_path(paths[i]);
+		if (!root)
+			goto next;
+
+		data = avflt_get_root_data_root(root);
+		redirfs_put_root(root);
+		if (!data)
+			goto next;
+
+		spin_lock(&data->lock);
+
+		if (data->policy == AVFLT_POLICY_SKIP)
+			policy = 's';
+		else if (data->policy == AVFLT_POLICY_HEAD)
+			policy = 'h';
+		else
+			policy = 'c';
+
+		size += snprintf(buf + size, PAGE_SIZE - size,
+				"%d:%c:%lld:%s:%c",
+				redirfs_get_id_path(paths[i]), policy,
+				(long long)data->policy_size,
+				data->policy_exts,
+				avflt_timeout_policy_char(
+					data->timeout_policy)) + 1;
+
+		spin_unlock(&data->lock);
+		avflt_put_root_data(data);
+
+		if (size >= PAGE_SIZE)
+			break;
+next:
+		i++;
+	}
+
+	redirfs_put_paths(paths);
+	return size;
+}
+
+/*
+ * c:<id>		check whole files regardless of their size
+ * s:<id>:<size>	skip files bigger than size
+ * h:<id>:<size>	check only the first size bytes of bigger files
+ * x:<id>:<ext,...>	skip files with listed extensions, empty list clears
+ * t:<id>:<policy>	reply timeout policy for the path, g uses the global
+ *			one set in the timeout attribute
+ */
+static ssize_t avflt_policy_paths_store(redirfs_filter filter,
+		struct redirfs_filter_attribute *attr, const char *buf,
+		size_t count)
+{
+	struct avflt_root_data *data;
+	long long size = 0;
+	const char *exts;
+	char timeout;
+	char policy;
+	int tpolicy = 0;
+	size_t len;
+	int id;
+
+	if (sscanf(buf, "%c:%d", &policy, &id) != 2)
+		return -EINVAL;
+
+	if (policy == 't') {
+		if (sscanf(buf, "%c:%d:%c", &policy, &id, &timeout) != 3)
+			return -EINVAL;
+
+		tpolicy = avflt_timeout_policy_parse(timeout);
+		if (tpolicy == -EINVAL)
+			return -EINVAL;
+
+	} else if (policy == 's' || policy == 'h') {
+		if (sscanf(buf, "%c:%d:%lld", &policy, &id, &size) != 3)
+			return -EINVAL;
+
+		if (size <= 0)
+			return -EINVAL;
+
+	} else if (policy != 'c' && policy != 'x')
+		return -EINVAL;
+
+	exts = strchr(strchr(buf, ':') + 1, ':');
+	if (exts)
+		exts++;
+	else
+		exts = "";
+
+	len = strcspn(exts, "\n");
+	if (len >= AVFLT_POLICY_EXTS_LEN)
+		return -EINVAL;
+
+	data = avflt_get_root_data_id(id);
+	if (!data)
+		return -ENOENT;
+
+	spin_lock(&data->lock);
+
+	switch (policy) {
+		case 'c':
+			data->policy = AVFLT_POLICY_CHECK;
+			data->policy_size = 0;
+			break;
+
+		case 's':
+			data->policy = AVFLT_POLICY_SKIP;
+			data->policy_size = size;
+			break;
+
+		case 'h':
+			data->policy = AVFLT_POLICY_HEAD;
+			data->policy_size = size;
+			break;
+
+		case 'x':
+			memcpy(data->policy_exts, exts, len);
+			data->policy_exts[len] = 0;
+			break;
+
+		case 't':
+			data->timeout_policy = tpolicy;
+			break;
+	}
+
+	spin_unlock(&data->lock);
+	avflt_put_root_data(data);
+
+	return count;
+}
+
 static ssize_t avflt_registered_show(redirfs_filter filter,
 		struct redirfs_filter_attribute *attr, char *buf)
 {
@@ -199,6 +562,12 @@ static ssize_t avflt_trusted_show(redirfs_filter filter,
 	return avflt_trusted_get_info(buf, PAGE_SIZE);
 }
 
+static ssize_t avflt_queue_show(redirfs_filter filter,
+		struct redirfs_filter_attribute *attr, char *buf)
+{
+	return avflt_queue_get_info(buf, PAGE_SIZE);
+}
+
 static struct redirfs_filter_attribute avflt_timeout_attr = 
 	REDIRFS_FILTER_ATTRIBUTE(timeout, 0644, avflt_timeout_show,
 			avflt_timeout_store);
@@ -211,12 +580,41 @@ static struct redirfs_filter_attribute avflt_pathcache_attr =
 	REDIRFS_FILTER_ATTRIBUTE(cache_paths, 0644, avflt_cache_paths_show,
 			avflt_cache_paths_store);
 
+static struct redirfs_filter_attribute avflt_policypaths_attr = 
+	REDIRFS_FILTER_ATTRIBUTE(policy_paths, 0644, avflt_policy_paths_show,
+			avflt_policy_paths_store);
+
+static struct redirfs_filter_attribute avflt_fingerprint_attr = 
+	REDIRFS_FILTER_ATTRIBUTE(fingerprint, 0644, avflt_fingerprint_show,
+			avflt_fingerprint_store);
+
+static struct redirfs_filter_attribute avflt_queuelimit_attr = 
+	REDIRFS_FILTER_ATTRIBUTE(queue_limit, 0644, avflt_queue_limit_show,
+			avflt_queue_limit_store);
+
+static struct redirfs_filter_attribute avflt_overload_attr = 
+	REDIRFS_FILTER_ATTRIBUTE(overload, 0444, avflt_overload_show, NULL);
+
+static struct redirfs_filter_attribute avflt_cachestats_attr = 
+	REDIRFS_FILTER_ATTRIBUTE(cache_stats, 0444, avflt_cache_stats_show,
+			NULL);
+
+static struct redirfs_filter_attribute avflt_load_attr = 
+	REDIRFS_FILTER_ATTRIBUTE(load, 0444, avflt_load_show, NULL);
+
+static struct redirfs_filter_attribute avflt_quota_attr = 
+	REDIRFS_FILTER_ATTRIBUTE(quota, 0644, avflt_quota_show,
+			avflt_quota_store);
+
 static struct redirfs_filter_attribute avflt_registered_attr = 
 	REDIRFS_FILTER_ATTRIBUTE(registered, 0444, avflt_registered_show, NULL);
 
 static struct redirfs_filter_attribute avflt_trusted_attr = 
 	REDIRFS_FILTER_ATTRIBUTE(trusted, 0444, avflt_trusted_show, NULL);
 
+static struct redirfs_filter_attribute avflt_queue_attr = 
+	REDIRFS_FILTER_ATTRIBUTE(queue, 0444, avflt_queue_show, NULL);
+
 int avflt_sys_init(void)
 {
 	int rv;
@@ -241,8 +639,56 @@ int avflt_sys_init(void)
 	if (rv)
 		goto err_trusted;
 
+	rv = redirfs_create_attribute(avflt, &avflt_queue_attr);
+	if (rv)
+		goto err_queue;
+
+	rv = redirfs_create_attribute(avflt, &avflt_policypaths_attr);
+	if (rv)
+		goto err_policypaths;
+
+	rv = redirfs_create_attribute(avflt, &avflt_fingerprint_attr);
+	if (rv)
+		goto err_fingerprint;
+
+	rv = redirfs_create_attribute(avflt, &avflt_queuelimit_attr);
+	if (rv)
+		goto err_queuelimit;
+
+	rv = redirfs_create_attribute(avflt, &avflt_overload_attr);
+	if (rv)
+		goto err_overload;
+
+	rv = redirfs_create_attribute(avflt, &avflt_load_attr);
+	if (rv)
+		goto err_load;
+
+	rv = redirfs_create_attribute(avflt, &avflt_quota_attr);
+	if (rv)
+		goto err_quota;
+
+	rv = redirfs_create_attribute(avflt, &avflt_cachestats_attr);
+	if (rv)
+		goto err_cachestats;
+
 	return 0;
 
+err_cachestats:
+	redirfs_remove_attribute(avflt, &avflt_quota_attr);
+err_quota:
+	redirfs_remove_attribute(avflt, &avflt_load_attr);
+err_load:
+	redirfs_remove_attribute(avflt, &avflt_overload_attr);
+err_overload:
+	redirfs_remove_attribute(avflt, &avflt_queuelimit_attr);
+err_queuelimit:
+	redirfs_remove_attribute(avflt, &avflt_fingerprint_attr);
+err_fingerprint:
+	redirfs_remove_attribute(avflt, &avflt_policypaths_attr);
+err_policypaths:
+	redirfs_remove_attribute(avflt, &avflt_queue_attr);
+err_queue:
+	redirfs_remove_attribute(avflt, &avflt_trusted_attr);
 err_trusted:
 	redirfs_remove_attribute(avflt, &avflt_registered_attr);
 err_registered:
@@ -261,5 +707,13 @@ void avflt_sys_exit(void)
 	redirfs_remove_attribute(avflt, &avflt_pathcache_attr);
 	redirfs_remove_attribute(avflt, &avflt_registered_attr);
 	redirfs_remove_attribute(avflt, &avflt_trusted_attr);
+	redirfs_remove_attribute(avflt, &avflt_queue_attr);
+	redirfs_remove_attribute(avflt, &avflt_policypaths_attr);
+	redirfs_remove_attribute(avflt, &avflt_fingerprint_attr);
+	redirfs_remove_attribute(avflt, &avflt_queuelimit_attr);
+	redirfs_remove_attribute(avflt, &avflt_overload_attr);
+	redirfs_remove_attribute(avflt, &avflt_load_attr);
+	redirfs_remove_attribute(avflt, &avflt_quota_attr);
+	redirfs_remove_attribute(avflt, &avflt_cachestats_attr);
 }
 
@@ -5,6 +5,10 @@
  *          http://www.boost.org/LICENSE_1_0.txt)
  */
 
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/wait.h>
 #include <pthread.h>
 #include <limits.h>
 #include <stdio.h>
@@ -13,60 +17,169 @@
 #include <signal.h>
 #include <unistd.h>
 #include <string.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <time.h>
+#include <getopt.h>
 #include <av.h>
 
 #define THREADS_COUNT 10
+#define QUEUE_FILE "/sys/fs/redirfs/filters/avflt/queue"
+#define CACHE_STATS_FILE "/sys/fs/redirfs/filters/avflt/cache_stats"
+#define WAIT_BUCKETS 16
+
+static const char *version = "0.2";
+
+static const char *help =
+"-s, --scanners <n>     number of scanner threads, default 10\n"
+"-l, --latency <usec>   synthetic scan latency per event\n"
+"-i, --infected <n>     deny access to every n-th event\n"
+"-n, --no-cache         do not cache scan results\n"
+"-w, --workload <dir>   open and close files under <dir>\n"
+"-c, --clients <n>      number of workload threads, default 1\n"
+"-d, --duration <sec>   workload duration, default 10\n"
+"-q, --quiet            do not print events\n"
+"-h, --help             print help\n"
+"-v, --version          print version\n";
+
+static const char *usage =
+"avtest [-s <n>] [-l <usec>] [-i <n>] [-n] [-q]\n"
+"       [-w <dir> [-c <n>] [-d <sec>]]";
+
+static const char *sopts = "s:l:i:nw:c:d:qhv";
+
+static struct option lopts[] = {
+	{"scanners", 1, 0, 's'},
+	{"latency", 1, 0, 'l'},
+	{"infected", 1, 0, 'i'},
+	{"no-cache", 0, 0, 'n'},
+	{"workload", 1, 0, 'w'},
+	{"clients", 1, 0, 'c'},
+	{"duration", 1, 0, 'd'},
+	{"quiet", 0, 0, 'q'},
+	{"help", 0, 0, 'h'},
+	{"version", 0, 0, 'v'},
+	{0, 0, 0, 0}
+};
 
-static const char *version = "0.1";
+struct queue_stats {
+	unsigned long dispatched;
+	unsigned long long wait_total;
+	unsigned int wait_max;
+	unsigned long wait_hist[WAIT_BUCKETS];
+	unsigned long cache_hits;
+	unsigned long cache_misses;
+};
+
+struct workload_stats {
+	unsigned long opens;
+	unsigned long denied;
+	unsigned long timeouts;
+	unsigned long errors;
+	double elapsed;
+	double p50;
+	double p90;
+	double p99;
+	double max;
+};
+
+struct client {
+	pthread_t thread;
+	unsigned int seed;
+	double *samples;
+	unsigned long count;
+	unsigned long size;
+	unsigned long denied;
+	unsigned long timeouts;
+	unsigned long errors;
+};
 
 static struct av_connection av_conn;
-static int stop = 0;
+static struct av_loop av_loop;
+static int scanners = THREADS_COUNT;
+static int latency = 0;
+static int infected = 0;
+static int cache = AV_CACHE_ENABLE;
+static char *workload = NULL;
+static int clients = 1;
+static int duration = 10;
+static int quiet = 0;
+
+static unsigned long events = 0;
+static unsigned long events_open = 0;
+static unsigned long events_denied = 0;
+
+static char **files = NULL;
+static unsigned long files_count = 0;
+static unsigned long files_size = 0;
+static volatile int stop = 0;
 
 static void sighandler(int sig)
 {
 	stop = 1;
+
+	/* the workload process gets the signal as well, but has no loop */
+	if (av_loop.epoll_fd > 0)
+		av_loop_stop(&av_loop);
 }
 
-static int check(void)
+static double now(void)
 {
-	struct av_event av_event;
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int check(struct av_event *av_event, void *data)
+{
+	struct timespec ts;
 	char fn[PATH_MAX];
+	unsigned long id;
+	int res = AV_ACCESS_ALLOW;
 
-	while (!stop) {
-		if (av_request(&av_conn, &av_event, 500)) {
-			if (errno == ETIMEDOUT)
-				continue;
+	id = __sync_add_and_fetch(&events, 1);
+	if (av_event->type == AV_EVENT_OPEN)
+		__sync_add_and_fetch(&events_open, 1);
 
-			perror("av_request failed");
-			return -1;
-		}
+	if (latency) {
+		ts.tv_sec = latency / 1000000;
+		ts.tv_nsec = (latency % 1000000) * 1000;
+		nanosleep(&ts, NULL);
+	}
 
-		if (av_get_filename(&av_event, fn, PATH_MAX)) {
-			perror("av_get_filename failed");
-			return -1;
-		}
+	if (infected && !(id % infected)) {
+		__sync_add_and_fetch(&events_denied, 1);
+		res = AV_ACCESS_DENY;
+	}
 
-		if (av_set_result(&av_event, AV_ACCESS_ALLOW)) {
-			perror("av_set_result failed");
-			return -1;
-		}
+	if (av_set_result(av_event, res)) {
+		perror("av_set_result failed");
+		return -1;
+	}
 
-		printf("thread[%lu]: id: %d, type: %d, fd: %d, pid: %d, "
-				"tgid: %d, res: %d, fn: %s\n", pthread_self(),
-				av_event.id, av_event.type, av_event.fd,
-				av_event.pid, av_event.tgid, av_event.res, fn);
+	if (av_set_cache(av_event, cache)) {
+		perror("av_set_cache failed");
+		return -1;
+	}
 
-		if (av_reply(&av_conn, &av_event)) {
-			perror("av_reply failed");
-			return -1;
-		}
+	if (quiet)
+		return 0;
 
+	if (av_get_filename(av_event, fn, PATH_MAX)) {
+		perror("av_get_filename failed");
+		return -1;
 	}
 
+	printf("thread[%lu]: id: %d, type: %d, fd: %d, pid: %d, "
+			"tgid: %d, res: %d, fn: %s\n", pthread_self(),
+			av_event->id, av_event->type, av_event->fd,
+			av_event->pid, av_event->tgid, av_event->res, fn);
+
 	return 0;
 }
 
-static void *check_thread(void *data)
+static void *loop_thread(void *data)
 {
 	sigset_t sigmask;
 
@@ -75,22 +188,409 @@ static void *check_thread(void *data)
 	sigaddset(&sigmask, SIGTERM);
 	pthread_sigmask(SIG_BLOCK, &sigmask, NULL);
 
-	if (check())
-		fprintf(stderr, "thread[%lu] unexpectedly stopped, %s\n",
-				pthread_self(), strerror(errno));
+	if (av_loop_run(&av_loop))
+		fprintf(stderr, "event loop unexpectedly stopped, %s\n",
+				strerror(errno));
 
 	return NULL;
 }
 
-int main(int argc, char *argv[])
+static ssize_t read_file(const char *fn, char *buf, size_t size)
 {
+	ssize_t len;
+	int fd;
 
-	pthread_t threads[THREADS_COUNT];
-	struct sigaction sa;
+	fd = open(fn, O_RDONLY);
+	if (fd == -1)
+		return -1;
+
+	len = read(fd, buf, size - 1);
+	close(fd);
+	if (len == -1)
+		return -1;
+
+	buf[len] = 0;
+
+	return len;
+}
+
+static int read_queue_stats(struct queue_stats *qs)
+{
+	unsigned long long wait_total;
+	unsigned long dispatched;
+	unsigned int wait_max;
+	char buf[4096];
+	char *hist;
+	ssize_t len;
+	ssize_t off;
+	int n;
+	int i;
+
+	memset(qs, 0, sizeof(struct queue_stats));
+
+	if (read_file(CACHE_STATS_FILE, buf, sizeof(buf)) != -1)
+		sscanf(buf, "hits:%lu,misses:%lu", &qs->cache_hits,
+				&qs->cache_misses);
+
+	len = read_file(QUEUE_FILE, buf, sizeof(buf));
+	if (len == -1)
+		return -1;
+
+	/* <class>:<depth>:<dispatched>:<wait total>:<wait max>:<wait hist> */
+	for (off = 0; off < len; off += strlen(buf + off) + 1) {
+		if (sscanf(buf + off, "%*d:%*d:%lu:%llu:%u%n", &dispatched,
+					&wait_total, &wait_max, &n) != 3)
+			continue;
+
+		qs->dispatched += dispatched;
+		qs->wait_total += wait_total;
+		if (wait_max > qs->wait_max)
+			qs->wait_max = wait_max;
+
+		hist = buf + off + n;
+		for (i = 0; i < WAIT_BUCKETS && *hist; i++)
+			qs->wait_hist[i] += strtoul(hist + 1, &hist, 10);
+	}
+
+	return 0;
+}
+
+static int add_file(const char *fn, const struct stat *st, int flag,
+		struct FTW *ftw)
+{
+	char **tmp;
+
+	if (flag != FTW_F || !S_ISREG(st->st_mode))
+		return 0;
+
+	if (files_count == files_size) {
+		files_size = files_size ? files_size * 2 : 1024;
+		tmp = realloc(files, files_size * sizeof(char *));
+		if (!tmp)
+			return -1;
+
+		files = tmp;
+	}
+
+	files[files_count] = strdup(fn);
+	if (!files[files_count])
+		return -1;
+
+	files_count++;
+
+	return 0;
+}
+
+static int add_sample(struct client *client, double sample)
+{
+	double *tmp;
+
+	if (client->count == client->size) {
+		client->size = client->size ? client->size * 2 : 4096;
+		tmp = realloc(client->samples, client->size * sizeof(double));
+		if (!tmp)
+			return -1;
+
+		client->samples = tmp;
+	}
+
+	client->samples[client->count++] = sample;
+
+	return 0;
+}
+
+static void *client_thread(void *data)
+{
+	struct client *client = data;
+	double start;
+	char *fn;
+	int fd;
+
+	while (!stop) {
+		fn = files[rand_r(&client->seed) % files_count];
+
+		start = now();
+		fd = open(fn, O_RDONLY);
+		if (add_sample(client, now() - start))
+			break;
+
+		if (fd != -1) {
+			close(fd);
+			continue;
+		}
+
+		if (errno == EPERM)
+			client->denied++;
+		else if (errno == ETIMEDOUT)
+			client->timeouts++;
+		else
+			client->errors++;
+	}
+
+	return NULL;
+}
+
+static int cmp_sample(const void *s1, const void *s2)
+{
+	double d1 = *(const double *)s1;
+	double d2 = *(const double *)s2;
+
+	return (d1 > d2) - (d1 < d2);
+}
+
+static double percentile(double *samples, unsigned long count, int p)
+{
+	if (!count)
+		return 0;
+
+	return samples[(count - 1) * p / 100];
+}
+
+static int run_workload(struct workload_stats *ws)
+{
+	struct client *cl;
+	double *samples;
+	double start;
+	unsigned long count = 0;
+	int started;
 	int i;
+
+	memset(ws, 0, sizeof(struct workload_stats));
+
+	if (nftw(workload, add_file, 16, FTW_PHYS) || !files_count) {
+		fprintf(stderr, "no regular files found in %s\n", workload);
+		return -1;
+	}
+
+	cl = calloc(clients, sizeof(struct client));
+	if (!cl)
+		return -1;
+
+	start = now();
+
+	for (started = 0; started < clients; started++) {
+		cl[started].seed = started + 1;
+		if (pthread_create(&cl[started].thread, NULL, client_thread,
+					&cl[started])) {
+			fprintf(stderr, "pthread_create failed\n");
+			stop = 1;
+			break;
+		}
+	}
+
+	while (!stop && now() - start < duration)
+		sleep(1);
+
+	stop = 1;
+
+	for (i = 0; i < started; i++) {
+		pthread_join(cl[i].thread, NULL);
+		count += cl[i].count;
+	}
+
+	ws->elapsed = now() - start;
+
+	samples = NULL;
+	if (started == clients)
+		samples = malloc((count + 1) * sizeof(double));
+
+	if (!samples) {
+		for (i = 0; i < started; i++)
+			free(cl[i].samples);
+
+		free(cl);
+		return -1;
+	}
+
+	for (i = 0, count = 0; i < clients; i++) {
+		memcpy(samples + count, cl[i].samples,
+				cl[i].count * sizeof(double));
+		count += cl[i].count;
+		ws->denied += cl[i].denied;
+		ws->timeouts += cl[i].timeouts;
+		ws->errors += cl[i].errors;
+		free(cl[i].samples);
+	}
+
+	qsort(samples, count, sizeof(double), cmp_sample);
+
+	ws->opens = count;
+	ws->p50 = percentile(samples, count, 50);
+	ws->p90 = percentile(samples, count, 90);
+	ws->p99 = percentile(samples, count, 99);
+	ws->max = percentile(samples, count, 100);
+
+	free(samples);
+	free(cl);
+
+	return 0;
+}
+
+/*
+ * The workload has to run in a separate process, because avflt does not send
+ * events for files accessed by registered processes.
+ */
+static pid_t start_workload(int *go, int *result)
+{
+	struct workload_stats ws;
+	int pgo[2];
+	int pres[2];
+	char c;
+	pid_t pid;
+
+	if (pipe(pgo) || pipe(pres))
+		return -1;
+
+	fflush(stdout);
+	pid = fork();
+	if (pid) {
+		close(pgo[0]);
+		close(pres[1]);
+		*go = pgo[1];
+		*result = pres[0];
+		return pid;
+	}
+
+	close(pgo[1]);
+	close(pres[0]);
+
+	if (read(pgo[0], &c, 1) != 1)
+		exit(EXIT_FAILURE);
+
+	if (run_workload(&ws))
+		exit(EXIT_FAILURE);
+
+	if (write(pres[1], &ws, sizeof(ws)) != sizeof(ws))
+		exit(EXIT_FAILURE);
+
+	exit(EXIT_SUCCESS);
+}
+
+/*
+ * Returns the upper bound in msecs of the histogram bucket with the p-th
+ * percentile of the queue wait, bucket n holds waits below 2^n msecs.
+ */
+static unsigned int wait_percentile(unsigned long *hist, unsigned long count,
+		int p)
+{
+	unsigned long sum = 0;
+	int i;
+
+	if (!count)
+		return 0;
+
+	for (i = 0; i < WAIT_BUCKETS - 1; i++) {
+		sum += hist[i];
+		if (sum * 100 >= count * p)
+			break;
+	}
+
+	return 1U << i;
+}
+
+static void report(struct workload_stats *ws, struct queue_stats *qs1,
+		struct queue_stats *qs2)
+{
+	unsigned long hist[WAIT_BUCKETS];
+	unsigned long dispatched;
+	unsigned long lookups;
+	double wait_avg = 0;
+	double hits = 0;
+	int i;
+
+	dispatched = qs2->dispatched - qs1->dispatched;
+	if (dispatched)
+		wait_avg = (double)(qs2->wait_total - qs1->wait_total) /
+			dispatched;
+
+	for (i = 0; i < WAIT_BUCKETS; i++)
+		hist[i] = qs2->wait_hist[i] - qs1->wait_hist[i];
+
+	lookups = qs2->cache_hits - qs1->cache_hits +
+		qs2->cache_misses - qs1->cache_misses;
+	if (lookups)
+		hits = 100.0 * (qs2->cache_hits - qs1->cache_hits) / lookups;
+
+	printf("duration:        %.2f s\n", ws->elapsed);
+	printf("opens:           %lu (%.0f/s)\n", ws->opens,
+			ws->opens / ws->elapsed);
+	printf("events:          %lu (%.0f/s), open: %lu, denied: %lu\n",
+			events, events / ws->elapsed, events_open,
+			events_denied);
+	printf("open latency:    p50 %.3f ms, p90 %.3f ms, p99 %.3f ms, "
+			"max %.3f ms\n", ws->p50 * 1e3, ws->p90 * 1e3,
+			ws->p99 * 1e3, ws->max * 1e3);
+	printf("queue wait:      avg %.3f ms, p50 < %u ms, p90 < %u ms, "
+			"p99 < %u ms, max %u ms\n", wait_avg,
+			wait_percentile(hist, dispatched, 50),
+			wait_percentile(hist, dispatched, 90),
+			wait_percentile(hist, dispatched, 99), qs2->wait_max);
+	printf("cache hit ratio: %.2f %%\n", hits);
+	printf("open failures:   denied %lu, timeouts %lu, errors %lu\n",
+			ws->denied, ws->timeouts, ws->errors);
+}
+
+int main(int argc, char *argv[])
+{
+	struct workload_stats ws;
+	struct queue_stats qs1;
+	struct queue_stats qs2;
+	struct sigaction sa;
+	pthread_t thread;
+	pid_t pid = 0;
+	int go = -1;
+	int result = -1;
+	int status;
+	int opt;
 	int rv;
 
+	while ((opt = getopt_long(argc, argv, sopts, lopts, NULL)) != -1) {
+		switch (opt) {
+			case 's':
+				scanners = atoi(optarg);
+				break;
+			case 'l':
+				latency = atoi(optarg);
+				break;
+			case 'i':
+				infected = atoi(optarg);
+				break;
+			case 'n':
+				cache = AV_CACHE_DISABLE;
+				break;
+			case 'w':
+				workload = optarg;
+				quiet = 1;
+				break;
+			case 'c':
+				clients = atoi(optarg);
+				break;
+			case 'd':
+				duration = atoi(optarg);
+				break;
+			case 'q':
+				quiet = 1;
+				break;
+			case 'h':
+				printf("%s\n%s", usage, help);
+				exit(EXIT_SUCCESS);
+			case 'v':
+				printf("avtest: version %s\n", version);
+				exit(EXIT_SUCCESS);
+			default:
+				fprintf(stderr, "%s\n", usage);
+				exit(EXIT_FAILURE);
+		}
+	}
+
+	if (scanners < 1 || latency < 0 || infected < 0 || clients < 1 ||
+			duration < 1) {
+		fprintf(stderr, "%s\n", usage);
+		exit(EXIT_FAILURE);
+	}
+
 	printf("avtest: version %s\n", version);
+
 	memset(&sa, 0, sizeof(struct sigaction));
 	sa.sa_handler = sighandler;
 	sigemptyset(&sa.sa_mask);
@@ -99,29 +599,65 @@ int main(int argc, char *argv[])
 	sigaction(SIGTERM, &sa, NULL);
 	sigaction(SIGINT, &sa, NULL);
 
+	if (workload) {
+		pid = start_workload(&go, &result);
+		if (pid == -1) {
+			perror("start_workload failed");
+			exit(EXIT_FAILURE);
+		}
+	}
+
 	if (av_register(&av_conn)) {
 		perror("av_register failed");
 		exit(EXIT_FAILURE);
 	}
 
-	for (i = 0; i < THREADS_COUNT; i++) {
-		rv = pthread_create(&threads[i], NULL, check_thread, NULL);
-		if (rv) {
-			fprintf(stderr, "pthread_create failed: %d\n", rv);
-			exit(EXIT_FAILURE);
-		}
+	if (av_loop_init(&av_loop, &av_conn, scanners, check, NULL)) {
+		perror("av_loop_init failed");
+		exit(EXIT_FAILURE);
 	}
 
-	pause();
+	rv = pthread_create(&thread, NULL, loop_thread, NULL);
+	if (rv) {
+		fprintf(stderr, "pthread_create failed: %d\n", rv);
+		exit(EXIT_FAILURE);
+	}
 
-	for (i = 0; i < THREADS_COUNT; i++) {
-		rv = pthread_join(threads[i], NULL);
-		if (rv) {
-			fprintf(stderr, "pthread_join failed: %d\n", rv);
-			exit(EXIT_FAILURE);
+	if (workload) {
+		read_queue_stats(&qs1);
+
+		if (write(go, "g", 1) != 1) {
+			perror("workload start failed");
+			kill(pid, SIGTERM);
 		}
+
+		while ((rv = read(result, &ws, sizeof(ws))) == -1 &&
+				errno == EINTR)
+			;
+
+		while (waitpid(pid, &status, 0) == -1 && errno == EINTR)
+			;
+
+		read_queue_stats(&qs2);
+
+		if (rv == sizeof(ws))
+			report(&ws, &qs1, &qs2);
+		else
+			fprintf(stderr, "workload failed\n");
+
+		av_loop_stop(&av_loop);
+
+	} else
+		pause();
+
+	rv = pthread_join(thread, NULL);
+	if (rv) {
+		fprintf(stderr, "pthread_join failed: %d\n", rv);
+		exit(EXIT_FAILURE);
 	}
 
+	av_loop_exit(&av_loop);
+
 	if (av_unregister(&av_conn)) {
 		perror("av_unregister failed");
 		exit(EXIT_FAILURE);
@@ -4,7 +4,6 @@
 #include <linux/mutex.h>
 #include "../redirfs/redirfs.h"
 #include "compflt.h"
-#include "path.h"
 
 char version[] = "0";
 
@@ -16,34 +15,78 @@ static int in_blksize = CFLT_DEFAULT_BLKSIZE;
 module_param(in_blksize, int, 0000);
 MODULE_PARM_DESC(in_blksize, "Initial block size to use");
 
-static enum rfs_retv cflt_f_pre_llseek(rfs_context context, struct rfs_args *args)
+static int in_cachesize = CFLT_DEFAULT_CACHE_SIZE >> 10;
+module_param(in_cachesize, int, 0000);
+MODULE_PARM_DESC(in_cachesize, "Decompressed block cache size in KB");
+
+static int in_readahead = CFLT_DEFAULT_RA_BLOCKS;
+module_param(in_readahead, int, 0000);
+MODULE_PARM_DESC(in_readahead, "Blocks to read ahead for sequential reads");
+
+static int in_compact = CFLT_DEFAULT_COMPACT;
+module_param(in_compact, int, 0000);
+MODULE_PARM_DESC(in_compact, "Compact files with more % of free space on release");
+
+static int in_minsaving = CFLT_DEFAULT_MIN_SAVING;
+module_param(in_minsaving, int, 0000);
+MODULE_PARM_DESC(in_minsaving, "Store blocks raw unless compression saves this %");
+
+static int in_writeback = CFLT_DEFAULT_WB_SIZE >> 10;
+module_param(in_writeback, int, 0000);
+MODULE_PARM_DESC(in_writeback, "Dirty data kept before compressing it in KB");
+
+// The file system only knows the size of the compressed data, so seeks in
+// compressed files are done here against the uncompressed size. i_size is
+// left alone, compflt reads the compressed data up to it.
+static enum redirfs_rv cflt_f_pre_llseek(redirfs_context context, struct redirfs_args *args)
 {
         struct file *f = args->args.f_llseek.file;
+        loff_t off = args->args.f_llseek.offset;
         struct cflt_file *fh;
+        enum redirfs_rv rv = REDIRFS_CONTINUE;
 
         cflt_debug_printk("compflt: [pre_llseek] i=%li\n",
                         f->f_dentry->d_inode->i_ino);
 
         fh = cflt_file_get(f->f_dentry->d_inode, f);
         if (!fh)
-                return RFS_CONTINUE;
+                return REDIRFS_CONTINUE;
 
         cflt_debug_file_header(fh);
 
         if (!atomic_read(&fh->compressed))
                 goto end;
 
-        cflt_debug_printk("compflt: setting inode->i_size to %i\n", fh->size_u);
-        mutex_lock(&f->f_dentry->d_inode->i_mutex);
-        i_size_write(f->f_dentry->d_inode, fh->size_u);
-        mutex_unlock(&f->f_dentry->d_inode->i_mutex);
+        switch (args->args.f_llseek.origin) {
+        case SEEK_END:
+                off += fh->size_u;
+                break;
+        case SEEK_CUR:
+                off += f->f_pos;
+                break;
+        case SEEK_SET:
+                break;
+        default:
+                off = -1;
+        }
 
+        if (off < 0 || off > f->f_dentry->d_inode->i_sb->s_maxbytes)
+                args->rv.rv_loff = -EINVAL;
+        else {
+                if (off != f->f_pos) {
+                        f->f_pos = off;
+                        f->f_version = 0;
+                }
+                args->rv.rv_loff = off;
+        }
+
+        rv = REDIRFS_STOP;
 end:
         cflt_file_put(fh);
-        return RFS_CONTINUE;
+        return rv;
 }
 
-static enum rfs_retv cflt_f_pre_open(rfs_context context, struct rfs_args *args)
+static enum redirfs_rv cflt_f_pre_open(redirfs_context context, struct redirfs_args *args)
 {
         struct file *f = args->args.f_open.file;
         struct inode *inode = args->args.f_open.inode;
@@ -60,10 +103,10 @@ static enum rfs_retv cflt_f_pre_open(rfs_context context, struct rfs_args *args)
                 }
         }
 
-        return RFS_CONTINUE;
+        return REDIRFS_CONTINUE;
 }
 
-static enum rfs_retv cflt_f_post_release(rfs_context context, struct rfs_args *args)
+static enum redirfs_rv cflt_f_post_release(redirfs_context context, struct redirfs_args *args)
 {
         struct inode *inode = args->args.f_release.inode;
         struct file *f = args->args.f_release.file;
@@ -73,33 +116,99 @@ static enum rfs_retv cflt_f_post_release(rfs_context context, struct rfs_args *a
 
         fh = cflt_file_get(inode, NULL);
         if (!fh)
-                return RFS_CONTINUE;
+                return REDIRFS_CONTINUE;
+
+        cflt_file_sync(f, fh, 0);
+        cflt_file_put(fh);
+
+        return REDIRFS_CONTINUE;
+}
+
+static enum redirfs_rv cflt_f_pre_flush(redirfs_context context, struct redirfs_args *args)
+{
+        struct file *f = args->args.f_flush.file;
+        struct cflt_file *fh;
+
+        cflt_debug_printk("compflt: [pre_flush] i=%li\n", f->f_dentry->d_inode->i_ino);
+
+        fh = cflt_file_get(f->f_dentry->d_inode, NULL);
+        if (!fh)
+                return REDIRFS_CONTINUE;
+
+        cflt_wb_flush(f, fh);
+        cflt_file_put(fh);
+
+        return REDIRFS_CONTINUE;
+}
+
+// the blocks buffered by compflt are written before the file system syncs
+static enum redirfs_rv cflt_f_pre_fsync(redirfs_context context, struct redirfs_args *args)
+{
+        struct file *f = args->args.f_fsync.file;
+        struct inode *inode = f->f_dentry->d_inode;
+        struct cflt_file *fh;
+        int err;
+
+        cflt_debug_printk("compflt: [pre_fsync] i=%li\n", inode->i_ino);
+
+        fh = cflt_file_get(inode, NULL);
+        if (!fh)
+                return REDIRFS_CONTINUE;
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,1,0)
+        // i_mutex is held by the VFS for the whole fsync
+        err = cflt_file_sync(f, fh, 1);
+#else
+        err = cflt_file_sync(f, fh, 0);
+#endif
+        cflt_file_put(fh);
+
+        if (err) {
+                args->rv.rv_int = err;
+                return REDIRFS_STOP;
+        }
+
+        return REDIRFS_CONTINUE;
+}
+
+// compressed files are mapped with decompressed pages (mmap.c)
+static enum redirfs_rv cflt_f_pre_mmap(redirfs_context context, struct redirfs_args *args)
+{
+        struct file *f = args->args.f_mmap.file;
+        struct vm_area_struct *vma = args->args.f_mmap.vma;
+        struct cflt_file *fh;
+        enum redirfs_rv rv = REDIRFS_CONTINUE;
+
+        cflt_debug_printk("compflt: [pre_mmap] i=%li\n", f->f_dentry->d_inode->i_ino);
+
+        fh = cflt_file_get(f->f_dentry->d_inode, f);
+        if (!fh)
+                return REDIRFS_CONTINUE;
 
         if (atomic_read(&fh->compressed)) {
-                cflt_file_write(f, fh);
-                cflt_file_write_block_headers(f, fh);
+                args->rv.rv_int = cflt_mmap(f, vma);
+                rv = REDIRFS_STOP;
         }
 
         cflt_file_put(fh);
-
-        return RFS_CONTINUE;
+        return rv;
 }
 
-static enum rfs_retv cflt_f_pre_read(rfs_context context, struct rfs_args *args)
+static enum redirfs_rv cflt_f_pre_read(redirfs_context context, struct redirfs_args *args)
 {
         struct file *f = args->args.f_read.file;
         size_t count = args->args.f_read.count;
         loff_t *pos = args->args.f_read.pos;
         char __user *dst = args->args.f_read.buf;
-        size_t *op_rv = &args->retv.rv_ssize;
+        size_t *op_rv = &args->rv.rv_ssize;
         struct cflt_file *fh;
-        enum rfs_retv rv = RFS_CONTINUE;
+        enum redirfs_rv rv = REDIRFS_CONTINUE;
 
         cflt_debug_printk("compflt: [pre_read] i=%li | pos=%i len=%i\n", f->f_dentry->d_inode->i_ino, (int)*pos, count);
 
         fh = cflt_file_get(f->f_dentry->d_inode, f);
         if (!fh)
-                return RFS_CONTINUE;
+                return REDIRFS_CONTINUE;
 
         cflt_debug_file(fh);
 
@@ -108,7 +217,7 @@ static enum rfs_retv cflt_f_pre_read(rfs_context context, struct rfs_args *args)
                 goto end;
         }
 
-        if (!cflt_cmethod) {
+        if (!fh->method) {
                 printk(KERN_ERR "compflt: no compression method set\n");
                 goto end;
         }
@@ -122,27 +231,27 @@ static enum rfs_retv cflt_f_pre_read(rfs_context context, struct rfs_args *args)
 
         cflt_debug_printk("compflt: [pre_read] returning: count=%i pos=%i\n", *op_rv, (int)*pos);
 
-        rv = RFS_STOP;
+        rv = REDIRFS_STOP;
 end:
         cflt_file_put(fh);
         return rv;
 }
 
-static enum rfs_retv cflt_f_pre_write(rfs_context context, struct rfs_args *args)
+static enum redirfs_rv cflt_f_pre_write(redirfs_context context, struct redirfs_args *args)
 {
         struct file *f = args->args.f_write.file;
         unsigned char *src = (unsigned char *) args->args.f_write.buf;
         size_t count = args->args.f_write.count;
         loff_t *pos = args->args.f_write.pos;
-        size_t *op_rv = &args->retv.rv_ssize;
+        size_t *op_rv = &args->rv.rv_ssize;
         struct cflt_file *fh;
-        enum rfs_retv rv = RFS_CONTINUE;
+        enum redirfs_rv rv = REDIRFS_CONTINUE;
 
         cflt_debug_printk("compflt: [pre_write] i=%li | pos=%i len=%i\n", f->f_dentry->d_inode->i_ino, (int)*pos, count);
 
         fh = cflt_file_get(f->f_dentry->d_inode, f);
         if (!fh)
-                return RFS_CONTINUE;
+                return REDIRFS_CONTINUE;
 
         cflt_debug_file_header(fh);
 
@@ -151,7 +260,13 @@ static enum rfs_retv cflt_f_pre_write(rfs_context context, struct rfs_args *args
                 goto end;
         }
 
-        if (!cflt_cmethod) {
+        if (!atomic_read(&fh->compressed)) {
+                // a new compressed file, use the method set for its path
+                fh->method = cflt_comp_method_for(f);
+                atomic_set(&fh->dirty, 1);
+        }
+
+        if (!fh->method) {
                 printk(KERN_ERR "compflt: no compression method set\n");
                 goto end;
         }
@@ -163,7 +278,7 @@ static enum rfs_retv cflt_f_pre_write(rfs_context context, struct rfs_args *args
         }
 
         if (cflt_write(f, fh, *pos, &count, src)) {
-                return RFS_CONTINUE;
+                goto end;
         }
 
         *op_rv = count;
@@ -172,7 +287,7 @@ static enum rfs_retv cflt_f_pre_write(rfs_context context, struct rfs_args *args
         cflt_debug_file(fh);
         cflt_debug_printk("compflt: [pre_write] returning: count=%i pos=%i\n", *op_rv, (int)*pos);
 
-        rv = RFS_STOP;
+        rv = REDIRFS_STOP;
 end:
         cflt_file_put(fh);
         return rv;
@@ -180,32 +295,43 @@ end:
 
 // ====================================
 
-rfs_filter compflt;
-static struct rfs_path_info path_info = {CFLT_INC_DIR, RFS_PATH_INCLUDE|RFS_PATH_SUBTREE};
-static struct rfs_filter_info flt_info = {"compflt", 999, 0};
-static struct rfs_op_info ops_info[] = {
-        {RFS_REG_FOP_OPEN, cflt_f_pre_open, NULL},
-        {RFS_REG_FOP_RELEASE, NULL, cflt_f_post_release},
-        {RFS_REG_FOP_LLSEEK, cflt_f_pre_llseek, NULL},
-        {RFS_REG_FOP_READ, cflt_f_pre_read, NULL},
-        {RFS_REG_FOP_WRITE, cflt_f_pre_write, NULL},
-        {RFS_OP_END, NULL, NULL}
+redirfs_filter compflt;
+
+// the filter is the last one before the filesystem, other filters see the
+// uncompressed data
+static struct redirfs_filter_info flt_info = {
+        .owner = THIS_MODULE,
+        .name = "compflt",
+        .priority = 900000000,
+        .active = 1
+};
+
+static struct redirfs_op_info ops_info[] = {
+        {REDIRFS_REG_FOP_OPEN, cflt_f_pre_open, NULL},
+        {REDIRFS_REG_FOP_RELEASE, NULL, cflt_f_post_release},
+        {REDIRFS_REG_FOP_FLUSH, cflt_f_pre_flush, NULL},
+        {REDIRFS_REG_FOP_FSYNC, cflt_f_pre_fsync, NULL},
+        {REDIRFS_REG_FOP_LLSEEK, cflt_f_pre_llseek, NULL},
+        {REDIRFS_REG_FOP_MMAP, cflt_f_pre_mmap, NULL},
+        {REDIRFS_REG_FOP_READ, cflt_f_pre_read, NULL},
+        {REDIRFS_REG_FOP_WRITE, cflt_f_pre_write, NULL},
+        {REDIRFS_OP_END, NULL, NULL}
 };
 
 static int __init compflt_init(void)
 {
         int err;
 
-        err = rfs_register_filter(&compflt, &flt_info);
-        if (err) {
-                printk(KERN_ERR "compflt: registration failed: error %d\n", err);
-                goto error;
-        }
+        cflt_comp_pools_init();
+        cflt_buf_init();
 
-        err = cflt_privd_cache_init();
-        if (err) {
-                printk(KERN_ERR "compflt: private data cache initialization failed: error %d\n", err);
-                goto error;
+        compflt = redirfs_register_filter(&flt_info);
+        if (IS_ERR(compflt)) {
+                err = PTR_ERR(compflt);
+                printk(KERN_ERR "compflt: registration failed: error %d\n", err);
+                cflt_comp_pools_deinit();
+                cflt_buf_deinit();
+                return err;
         }
 
         err = cflt_block_cache_init();
@@ -214,33 +340,34 @@ static int __init compflt_init(void)
                 goto error;
         }
 
-        err = cflt_file_cache_init();
+        err = cflt_cache_init();
         if (err) {
-                printk(KERN_ERR "compflt: cflt_file cache initialization failed: error %d\n", err);
+                printk(KERN_ERR "compflt: decompressed block cache initialization failed: error %d\n", err);
                 goto error;
         }
 
-        err = cflt_sysfs_init();
+        err = cflt_ra_init();
         if (err) {
-                printk(KERN_ERR "compflt: /sys initialization failed: error %d\n", err);
+                printk(KERN_ERR "compflt: readahead initialization failed: error %d\n", err);
                 goto error;
         }
 
-        err = rfs_set_operations(compflt, ops_info);
+        err = cflt_file_cache_init();
         if (err) {
-                printk(KERN_ERR "compflt: set operations failed: error %d\n", err);
+                printk(KERN_ERR "compflt: cflt_file cache initialization failed: error %d\n", err);
                 goto error;
         }
 
-        err = rfs_set_path(compflt, &path_info);
+        err = cflt_sysfs_init();
         if (err) {
-                printk(KERN_ERR "compflt: include path failed: error %d\n", err);
+                printk(KERN_ERR "compflt: /sys initialization failed: error %d\n", err);
                 goto error;
         }
 
-        err = rfs_activate_filter(compflt);
+        // paths are set through the redirfs sysfs interface of the filter
+        err = redirfs_set_operations(compflt, ops_info);
         if (err) {
-                printk(KERN_ERR "compflt: filter activation failed: error %d\n", err);
+                printk(KERN_ERR "compflt: set operations failed: error %d\n", err);
                 goto error;
         }
 
@@ -253,29 +380,42 @@ static int __init compflt_init(void)
                 printk(KERN_WARNING "compflt: failed to set initial compress method\n");
 
         cflt_file_blksize_set(in_blksize);
+        cflt_cache_size_set(in_cachesize);
+        cflt_ra_blocks_set(in_readahead);
+        cflt_wb_size_set(in_writeback);
+        cflt_file_compact_set(in_compact);
+        cflt_comp_min_saving_set(in_minsaving);
 
         return 0;
 
 error:
-        if (rfs_unregister_filter(compflt))
-                printk(KERN_ERR "compflt: unregistration failed: error %d\n", err);
+        cflt_comp_rules_clear();
+        cflt_comp_pools_deinit();
+        cflt_buf_deinit();
 
+        if (redirfs_unregister_filter(compflt)) {
+                printk(KERN_ERR "compflt: unregistration failed\n");
+                return err;
+        }
+
+        redirfs_delete_filter(compflt);
         return err;
 }
 
+// the filter is unregistered through the redirfs sysfs interface before the
+// module can be removed
 static void __exit compflt_exit(void)
 {
-        int err;
-
         cflt_sysfs_deinit();
+        redirfs_delete_filter(compflt);
 
-	err = rfs_unregister_filter(compflt);
-	if (err)
-                printk(KERN_ERR "compflt: unregistration failed: error %d\n", err);
-
-        cflt_privd_cache_deinit();
         cflt_file_cache_deinit();
+        cflt_ra_deinit();
+        cflt_cache_deinit();
         cflt_block_cache_deinit();
+        cflt_comp_rules_clear();
+        cflt_comp_pools_deinit();
+        cflt_buf_deinit();
 }
 
 module_init(compflt_init);
@@ -51,6 +51,10 @@ struct cflt_block* cflt_block_init(void)
         }
 
         blk->data_u = blk->data_c = NULL;
+        blk->cache = NULL;
+        blk->wb = NULL;
+        blk->ver = 0;
+        blk->state = 0;
         blk->par = NULL;
         blk->type = CFLT_BLK_NORM;
         atomic_set(&blk->dirty, 0);
@@ -58,6 +62,9 @@ struct cflt_block* cflt_block_init(void)
         blk->size_u = blk->size_c = 0;
 
         INIT_LIST_HEAD(&blk->file);
+        INIT_LIST_HEAD(&blk->wb_list);
+        RB_CLEAR_NODE(&blk->pos);
+        RB_CLEAR_NODE(&blk->idx);
 
         return blk;
 }
@@ -66,6 +73,7 @@ void cflt_block_deinit(struct cflt_block *blk)
 {
         cflt_debug_printk("compflt: [f:cflt_block_deinit]\n");
 
+        cflt_cache_del(blk);
         kmem_cache_free(cflt_block_cache, blk);
 }
 
@@ -101,6 +109,7 @@ int cflt_block_read_header(struct file *f, struct cflt_block *blk, loff_t *off)
                 blk->size_u = 0;
                 break;
         case CFLT_BLK_NORM:
+        case CFLT_BLK_RAW: // SC == SU, data stored uncompressed
                 // +--------------------+
                 // | T | OFFU | SC | SU |
                 // +--------------------+
@@ -111,8 +120,9 @@ int cflt_block_read_header(struct file *f, struct cflt_block *blk, loff_t *off)
                 memcpy(&blk->size_u, buf+boff, sizeof(u16));
                 break;
         default:
-                BUG();
-                break;
+                // not a header, the chain ends here
+                printk(KERN_ERR "compflt: bad block header at %i\n", blk->off_c);
+                return -EINVAL;
         }
 
         cflt_debug_block(blk);
@@ -149,6 +159,7 @@ int cflt_block_write_header(struct file *f, struct cflt_block *blk)
                 memset(buf+boff, 0, sizeof(u16));
                 break;
         case CFLT_BLK_NORM:
+        case CFLT_BLK_RAW:
                 // +--------------------+
                 // | T | OFFU | SC | SU |
                 // +--------------------+
@@ -164,8 +175,8 @@ int cflt_block_write_header(struct file *f, struct cflt_block *blk)
         }
 
         off = blk->off_c;
-        rv = cflt_orig_write(f, buf, sizeof(buf), &off);
-        if (!rv) {
+        rv = cflt_orig_write(f, blk->par, buf, sizeof(buf), &off);
+        if (rv != sizeof(buf)) {
                 printk(KERN_ERR "compflt: failed to write header\n");
                 return -1;
         }
@@ -180,20 +191,34 @@ static int cflt_block_read_c(struct file *f, struct cflt_block *blk)
 
         cflt_debug_printk("compflt: [f:cflt_block_read_c]\n");
 
-        cflt_orig_read(f, blk->data_c, blk->size_c, &off_data);
+        if (cflt_orig_read(f, blk->data_c, blk->size_c, &off_data) != blk->size_c)
+                return -EIO;
 
         return 0;
 }
 
-int cflt_block_read(struct file *f, struct cflt_block *blk, struct crypto_comp *tfm)
+static int cflt_block_read_data(struct file *f, struct cflt_block *blk, struct crypto_comp *tfm)
 {
         int err = 0;
 
-        cflt_debug_printk("compflt: [f:cflt_block_read]\n");
+        if (blk->type == CFLT_BLK_RAW) {
+                loff_t off_data = blk->off_c + CFLT_BH_SIZE;
 
-        blk->data_c = kmalloc(blk->size_c, GFP_KERNEL);
-        if (!blk->data_c)
-                return -ENOMEM;
+                // data_u holds one block of the file
+                if (blk->size_c > blk->par->blksize)
+                        return -EINVAL;
+
+                if (cflt_orig_read(f, blk->data_u, blk->size_c, &off_data) != blk->size_c) {
+                        printk(KERN_ERR "compflt: failed to read raw block\n");
+                        return -EIO;
+                }
+
+                return 0;
+        }
+
+        // the buffers are sized for the block size of the file
+        if (blk->size_u > blk->par->blksize || blk->size_c > 2*blk->par->blksize)
+                return -EINVAL;
 
         if ((err = cflt_block_read_c(f, blk))) {
                 printk(KERN_ERR "compflt: failed to read block error: %i\n", err);
@@ -205,27 +230,49 @@ int cflt_block_read(struct file *f, struct cflt_block *blk, struct crypto_comp *
                 return err;
         }
 
-        kfree(blk->data_c);
         return err;
 }
 
+// blk->data_u (CFLT_BUF_U) and blk->data_c (CFLT_BUF_C) are scratch buffers of
+// the caller, the uncompressed data is read into blk->data_u
+int cflt_block_read(struct file *f, struct cflt_block *blk, struct crypto_comp *tfm)
+{
+        int err;
+
+        cflt_debug_printk("compflt: [f:cflt_block_read]\n");
+
+        // off_c does not change while the data is read
+        down_read(&blk->par->layout);
+        err = cflt_block_read_data(f, blk, tfm);
+        up_read(&blk->par->layout);
+
+        return err;
+}
+
+// blk->data_u and blk->data_c are scratch buffers of the caller as for
+// cflt_block_read
 int cflt_block_write(struct file *f, struct cflt_block *blk, struct crypto_comp *tfm)
 {
         int err = 0;
         loff_t off_data;
         size_t old = blk->size_c;
+        char *data;
 
         cflt_debug_printk("compflt: [f:cflt_block_write]\n");
 
+        // sets blk->type, data_c is not written for raw blocks
         err = cflt_comp_block(tfm, blk);
         if (err)
                 return err;
 
         cflt_file_place_block(blk, old);
 
+        data = blk->type == CFLT_BLK_RAW ? blk->data_u : blk->data_c;
         off_data = blk->off_c + CFLT_BH_SIZE;
-        cflt_orig_write(f, blk->data_c, blk->size_c, &off_data);
+        cflt_orig_write(f, blk->par, data, blk->size_c, &off_data);
+
+        // outdates data decompressed by readahead in the meantime
+        cflt_cache_del(blk);
 
-        kfree(blk->data_c);
         return err;
 }
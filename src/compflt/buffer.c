@@ -0,0 +1,127 @@
+#include <linux/mm.h>
+#include <linux/gfp.h>
+#include <linux/percpu.h>
+#include <linux/cpumask.h>
+#include "compflt.h"
+
+// Block data is handled in scratch buffers sized for the block size of the
+// file, blksize bytes for uncompressed and twice that for compressed data.
+// The buffers are whole pages, the page order is kept in the first page, so
+// a buffer is released without its file. Released buffers are kept on
+// per-cpu lists for each order and reused, a few of each order per cpu,
+// instead of being freed. The lists are only touched with preemption
+// disabled, so they need no lock.
+
+#define CFLT_BUF_IDLE 2 // idle buffers of each order kept per cpu
+#define CFLT_BUF_ORDERS 5 // up to 2*CFLT_BLKSIZE_MAX with 4 KB pages
+
+struct cflt_buf_pool {
+        struct list_head idle[CFLT_BUF_ORDERS]; // the list_head is in the buffer
+        unsigned int cnt[CFLT_BUF_ORDERS];
+};
+
+static DEFINE_PER_CPU(struct cflt_buf_pool, cflt_buf_pools);
+
+static inline unsigned int cflt_buf_order(char *data)
+{
+        return page_private(virt_to_page(data));
+}
+
+// returns a buffer of the @kind (CFLT_BUF_U or CFLT_BUF_C) for blocks of
+// @fh, its contents are undefined
+char *cflt_buf_get(struct cflt_file *fh, int kind)
+{
+        struct cflt_buf_pool *pool;
+        struct list_head *buf = NULL;
+        unsigned int order;
+        char *data;
+
+        order = get_order(kind == CFLT_BUF_U ? fh->blksize : 2*fh->blksize);
+        BUG_ON(order >= CFLT_BUF_ORDERS);
+
+        pool = &get_cpu_var(cflt_buf_pools);
+        if (!list_empty(&pool->idle[order])) {
+                buf = pool->idle[order].next;
+                list_del(buf);
+                pool->cnt[order]--;
+        }
+        put_cpu_var(cflt_buf_pools);
+
+        if (buf)
+                return (char*)buf;
+
+        data = (char*)__get_free_pages(GFP_KERNEL, order);
+        if (!data)
+                return NULL;
+
+        set_page_private(virt_to_page(data), order);
+        return data;
+}
+
+void cflt_buf_put(char *data)
+{
+        struct cflt_buf_pool *pool;
+        struct list_head *buf = (struct list_head*)data;
+        unsigned int order;
+
+        if (!data)
+                return;
+
+        order = cflt_buf_order(data);
+
+        pool = &get_cpu_var(cflt_buf_pools);
+        if (pool->cnt[order] < CFLT_BUF_IDLE) {
+                list_add(buf, &pool->idle[order]);
+                pool->cnt[order]++;
+                buf = NULL;
+        }
+        put_cpu_var(cflt_buf_pools);
+
+        if (buf)
+                free_pages((unsigned long)buf, order);
+}
+
+// memory taken by the buffer @data in bytes
+unsigned long cflt_buf_size(char *data)
+{
+        return PAGE_SIZE << cflt_buf_order(data);
+}
+
+void cflt_buf_init(void)
+{
+        struct cflt_buf_pool *pool;
+        int cpu;
+        int i;
+
+        cflt_debug_printk("compflt: [f:cflt_buf_init]\n");
+
+        for_each_possible_cpu(cpu) {
+                pool = &per_cpu(cflt_buf_pools, cpu);
+                for (i = 0; i < CFLT_BUF_ORDERS; i++) {
+                        INIT_LIST_HEAD(&pool->idle[i]);
+                        pool->cnt[i] = 0;
+                }
+        }
+}
+
+void cflt_buf_deinit(void)
+{
+        struct cflt_buf_pool *pool;
+        struct list_head *buf;
+        int cpu;
+        int i;
+
+        cflt_debug_printk("compflt: [f:cflt_buf_deinit]\n");
+
+        for_each_possible_cpu(cpu) {
+                pool = &per_cpu(cflt_buf_pools, cpu);
+                for (i = 0; i < CFLT_BUF_ORDERS; i++) {
+                        while (!list_empty(&pool->idle[i])) {
+                                buf = pool->idle[i].next;
+                                list_del(buf);
+                                free_pages((unsigned long)buf, i);
+                        }
+                        pool->cnt[i] = 0;
+                }
+        }
+}
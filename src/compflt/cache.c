@@ -0,0 +1,221 @@
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include "compflt.h"
+
+// Decompressed blocks are kept in a global cache, so repeated and small
+// sequential reads of one block do not decompress it again. The cache is
+// bounded by cflt_cache_max bytes, the least recently used blocks are dropped
+// first and the shrinker drops them under memory pressure as well.
+
+struct cflt_cache_entry {
+        struct list_head lru;
+        struct cflt_block *blk;
+        char *data;
+        unsigned int size; // valid bytes in data
+        unsigned int order; // data is 2^order pages
+};
+
+static LIST_HEAD(cflt_cache_lru);
+static DEFINE_SPINLOCK(cflt_cache_l);
+static unsigned long cflt_cache_used = 0; // bytes
+static unsigned long cflt_cache_cnt = 0; // entries
+static unsigned long cflt_cache_max = CFLT_DEFAULT_CACHE_SIZE;
+
+static void cflt_cache_free(struct cflt_cache_entry *ce)
+{
+        free_pages((unsigned long)ce->data, ce->order);
+        kfree(ce);
+}
+
+// unlink @ce from the cache, has to be called with cflt_cache_l held
+static void cflt_cache_unlink(struct cflt_cache_entry *ce)
+{
+        list_del(&ce->lru);
+        ce->blk->cache = NULL;
+        cflt_cache_used -= PAGE_SIZE << ce->order;
+        cflt_cache_cnt--;
+}
+
+// drop the least recently used entries until the cache fits into @max
+// bytes, but at most @nr of them
+static void cflt_cache_evict(unsigned long nr, unsigned long max)
+{
+        struct cflt_cache_entry *ce;
+        LIST_HEAD(dead);
+
+        spin_lock(&cflt_cache_l);
+        while (nr-- && !list_empty(&cflt_cache_lru) && cflt_cache_used > max) {
+                ce = list_entry(cflt_cache_lru.prev, struct cflt_cache_entry, lru);
+                cflt_cache_unlink(ce);
+                list_add(&ce->lru, &dead);
+        }
+        spin_unlock(&cflt_cache_l);
+
+        while (!list_empty(&dead)) {
+                ce = list_entry(dead.next, struct cflt_cache_entry, lru);
+                list_del(&ce->lru);
+                cflt_cache_free(ce);
+        }
+}
+
+// copy the cached decompressed data of @blk to @data_u
+// returns 0 on hit and -ENOENT if the block is not cached
+int cflt_cache_get(struct cflt_block *blk, char *data_u)
+{
+        struct cflt_cache_entry *ce;
+
+        spin_lock(&cflt_cache_l);
+        ce = blk->cache;
+        if (!ce) {
+                spin_unlock(&cflt_cache_l);
+                return -ENOENT;
+        }
+
+        memcpy(data_u, ce->data, ce->size);
+        list_move(&ce->lru, &cflt_cache_lru);
+        spin_unlock(&cflt_cache_l);
+
+        cflt_debug_printk("compflt: [f:cflt_cache_get] hit\n");
+
+        return 0;
+}
+
+// store the decompressed data of @blk, replacing any older version
+// @ver: blk->ver the data belongs to, outdated data is not stored
+void cflt_cache_add(struct cflt_block *blk, char *data_u, unsigned int ver)
+{
+        struct cflt_cache_entry *ce;
+        struct cflt_cache_entry *old;
+        unsigned int order;
+
+        if (!cflt_cache_max || !blk->size_u)
+                return;
+
+        order = get_order(blk->size_u);
+
+        ce = kmalloc(sizeof(struct cflt_cache_entry), GFP_KERNEL);
+        if (!ce)
+                return;
+
+        ce->data = (char *)__get_free_pages(GFP_KERNEL | __GFP_NOWARN, order);
+        if (!ce->data) {
+                kfree(ce);
+                return;
+        }
+
+        memcpy(ce->data, data_u, blk->size_u);
+        ce->size = blk->size_u;
+        ce->order = order;
+        ce->blk = blk;
+
+        spin_lock(&cflt_cache_l);
+        if (blk->ver != ver) {
+                spin_unlock(&cflt_cache_l);
+                cflt_cache_free(ce);
+                return;
+        }
+
+        old = blk->cache;
+        if (old)
+                cflt_cache_unlink(old);
+
+        list_add(&ce->lru, &cflt_cache_lru);
+        blk->cache = ce;
+        cflt_cache_used += PAGE_SIZE << order;
+        cflt_cache_cnt++;
+        spin_unlock(&cflt_cache_l);
+
+        if (old)
+                cflt_cache_free(old);
+
+        if (cflt_cache_used > cflt_cache_max)
+                cflt_cache_evict(~0UL, cflt_cache_max);
+}
+
+// drop the cached data of @blk and any data of it being decompressed
+void cflt_cache_del(struct cflt_block *blk)
+{
+        struct cflt_cache_entry *ce;
+
+        spin_lock(&cflt_cache_l);
+        blk->ver++;
+        ce = blk->cache;
+        if (ce)
+                cflt_cache_unlink(ce);
+        spin_unlock(&cflt_cache_l);
+
+        if (ce)
+                cflt_cache_free(ce);
+}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,35)
+static int cflt_cache_shrink(int nr, gfp_t gfp_mask)
+#else
+static int cflt_cache_shrink(struct shrinker *s, int nr, gfp_t gfp_mask)
+#endif
+{
+        if (nr)
+                cflt_cache_evict(nr, 0);
+
+        return cflt_cache_cnt;
+}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,23)
+static struct shrinker *cflt_cache_shrinker;
+#else
+static struct shrinker cflt_cache_shrinker = {
+        .shrink = cflt_cache_shrink,
+        .seeks = DEFAULT_SEEKS
+};
+#endif
+
+int cflt_cache_init(void)
+{
+        cflt_debug_printk("compflt: [f:cflt_cache_init]\n");
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,23)
+        cflt_cache_shrinker = set_shrinker(DEFAULT_SEEKS, cflt_cache_shrink);
+        if (!cflt_cache_shrinker)
+                return -ENOMEM;
+#else
+        register_shrinker(&cflt_cache_shrinker);
+#endif
+
+        return 0;
+}
+
+void cflt_cache_deinit(void)
+{
+        cflt_debug_printk("compflt: [f:cflt_cache_deinit]\n");
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,23)
+        remove_shrinker(cflt_cache_shrinker);
+#else
+        unregister_shrinker(&cflt_cache_shrinker);
+#endif
+        cflt_cache_evict(~0UL, 0);
+}
+
+// true if decompressed blocks are kept at all
+int cflt_cache_enabled(void)
+{
+        return cflt_cache_max != 0;
+}
+
+int cflt_cache_size_set(unsigned long int new)
+{
+        cflt_cache_max = new << 10;
+        printk(KERN_INFO "compflt: block cache size set to %li KB\n", new);
+
+        cflt_cache_evict(~0UL, cflt_cache_max);
+
+        return 0;
+}
+
+int cflt_cache_size_get(char* buf, int bsize)
+{
+        int len = 0;
+        len = sprintf(buf, "%li\n", cflt_cache_max >> 10);
+        return len;
+}
@@ -1,22 +1,40 @@
 #include <linux/crypto.h>
 #include <linux/list.h>
+#include <linux/rbtree.h>
+#include <linux/rwsem.h>
 #include <linux/fs.h>
 #include <linux/sched.h>
 #include <linux/version.h>
+#include <linux/vmalloc.h>
 #include "../redirfs/redirfs.h"
 
-#define CFLT_MAGIC "\x06\x10\x19\x82"
+#define CFLT_MAGIC "\x06\x10\x19\x82" // format 1: block headers only
+#define CFLT_MAGIC_IDX "\x06\x10\x19\x83" // format 2: block headers and index
 #define CFLT_FH_SIZE 9
+#define CFLT_FH_IDX_SIZE 17 // format 2 file header
 #define CFLT_BH_SIZE 9
+#define CFLT_IE_SIZE 13 // block index entry
+#define CFLT_FREE_MAX 0xffff // largest size_c of a free block header (u16)
 #define CFLT_BLKSIZE_MIN 512
 #define CFLT_BLKSIZE_MAX 32768
 #define CFLT_BLKSIZE_MOD 512
 #define CFLT_DEFAULT_BLKSIZE 4096
 #define CFLT_DEFAULT_METHOD "deflate"
-enum { CFLT_BLK_NORM, CFLT_BLK_FREE }; // block types
+#define CFLT_DEFAULT_CACHE_SIZE (4 << 20) // decompressed block cache in bytes
+#define CFLT_DEFAULT_RA_BLOCKS 8 // blocks read ahead for sequential reads
+#define CFLT_DEFAULT_WB_SIZE (1 << 20) // dirty uncompressed data in bytes
+#define CFLT_DEFAULT_COMPACT 25 // compact files with more % of free space
+#define CFLT_DEFAULT_MIN_SAVING 5 // % a block has to shrink to be stored compressed
+#define CFLT_RAW_SKIP 4 // raw blocks in a row after which compression is skipped
+#define CFLT_RAW_PROBE 64 // try to compress every n-th block of skipping files
+enum { CFLT_BLK_NORM, CFLT_BLK_FREE, CFLT_BLK_RAW }; // block types
+enum { CFLT_BLK_RA }; // block state bits
+enum { CFLT_BUF_U, CFLT_BUF_C, CFLT_BUF_CNT }; // scratch buffer kinds
 
 struct cflt_block {
 	struct list_head file;
+        struct rb_node pos; // node in cflt_file->pos
+        struct rb_node idx; // node in cflt_file->idx (normal) or ->free (free)
         unsigned int type; // u8 (0 == free , 1 == normal)
 	unsigned int off_u; // u32
 	unsigned int off_c; // not written to file
@@ -25,32 +43,42 @@ struct cflt_block {
         struct cflt_file *par; // parent cflt_file
         char *data_u;
         char *data_c;
+        struct cflt_cache_entry *cache; // decompressed data (cache.c)
+        char *wb; // dirty uncompressed data (writeback.c)
+        struct list_head wb_list; // node in cflt_file->wb
+        unsigned int ver; // incremented on each write of the block
+        unsigned long state;
         atomic_t dirty;
 };
 
+// attached to the inode as redirfs data, the reference counter of rfs_data
+// counts the users
 struct cflt_file {
-	struct list_head all;
-        // ===
+        struct redirfs_data rfs_data;
 	struct list_head blks;
+        struct rb_root idx; // normal blocks by off_u
+        struct rb_root pos; // all blocks by off_c
+        struct rb_root free; // free blocks by size_c
+        unsigned int wasted; // bytes in free blocks
+        unsigned int raw_run; // blocks stored raw in a row
+        struct list_head wb; // dirty blocks
 	struct inode *inode;
 	unsigned int method; // u8
         unsigned int blksize; // u32
         unsigned int size_u; // whole uncompressed size
+        unsigned int fmt; // on-disk format (1 or 2)
+        unsigned int off_idx; // block index offset (format 2, 0 == none)
+        unsigned int cnt_idx; // blocks in the index
+        loff_t ra_next; // where a sequential read continues
         atomic_t compressed;
         atomic_t dirty;
-        atomic_t cnt;
-        wait_queue_head_t ref_w;
         spinlock_t lock;
-};
-
-struct cflt_privd {
-	struct list_head all;
-        struct rfs_priv_data rfs_data;
-        struct cflt_file *fh;
+        struct rw_semaphore layout; // block reads vs. compaction moving blocks
+        struct task_struct *locked; // syncing task holding i_mutex (fsync)
 };
 
 // base.c
-extern rfs_filter compflt;
+extern redirfs_filter compflt;
 
 // file.c
 struct cflt_file *cflt_file_get(struct inode*, struct file*);
@@ -60,7 +88,11 @@ int cflt_file_read_block_headers(struct file*, struct cflt_file*);
 void cflt_file_write_block_headers(struct file*, struct cflt_file*);
 
 void cflt_file_add_blk(struct cflt_file*, struct cflt_block*);
+void cflt_file_idx_add(struct cflt_file*, struct cflt_block*);
+void cflt_file_idx_invalidate(struct file*, struct cflt_file*);
 void cflt_file_del_blk(struct cflt_block *blk);
+struct cflt_block *cflt_file_first_blk(struct cflt_file*, loff_t);
+struct cflt_block *cflt_file_next_blk(struct cflt_block*);
 
 int cflt_file_place_block(struct cflt_block*, unsigned int);
 
@@ -71,8 +103,12 @@ void cflt_file_cache_deinit(void);
 struct cflt_file *cflt_file_find(struct inode*);
 int cflt_file_read(struct file*, struct cflt_file*);
 void cflt_file_write(struct file*, struct cflt_file*);
+int cflt_file_sync(struct file*, struct cflt_file*, int);
 int cflt_file_blksize_set(unsigned long int);
 int cflt_file_blksize_get(char*, int);
+int cflt_file_compact_set(unsigned long int);
+int cflt_file_compact_get(char*, int);
+int cflt_file_wasted_get(char*, int);
 
 // block.c
 int cflt_block_read_headers(struct file*, struct cflt_file*);
@@ -87,30 +123,75 @@ int cflt_block_write(struct file*, struct cflt_block*, struct crypto_comp*);
 
 // read_write.c
 ssize_t cflt_orig_read(struct file*, char __user*, size_t, loff_t*);
-ssize_t cflt_orig_write(struct file*, const char __user*, size_t, loff_t*);
+ssize_t cflt_orig_write(struct file*, struct cflt_file*, const char __user*, size_t, loff_t*);
 int cflt_read(struct file*, struct cflt_file*, loff_t, size_t*, char*);
 int cflt_write(struct file*, struct cflt_file*, loff_t, size_t*, char*);
 
 // compress.c
+struct cflt_tfm {
+        struct list_head list;
+        struct crypto_comp *tfm;
+        unsigned int mid; // compression method
+};
+
 extern char *cflt_method_known[];
 extern unsigned int cflt_cmethod;
-struct crypto_comp *cflt_comp_init(unsigned int);
-void cflt_comp_deinit(struct crypto_comp*);
+void cflt_comp_pools_init(void);
+void cflt_comp_pools_deinit(void);
+struct cflt_tfm *cflt_comp_get(unsigned int);
+void cflt_comp_put(struct cflt_tfm*);
 int cflt_decomp_block(struct crypto_comp*, struct cflt_block*);
 int cflt_comp_block(struct crypto_comp*, struct cflt_block*);
 int cflt_comp_method_set(const char*);
 int cflt_comp_method_get(char*, int);
+int cflt_comp_min_saving_set(unsigned long int);
+int cflt_comp_min_saving_get(char*, int);
+unsigned int cflt_comp_method_for(struct file*);
+int cflt_comp_rule_set(const char*, size_t);
+int cflt_comp_rules_get(char*, int);
+void cflt_comp_rules_clear(void);
+
+// cache.c
+int cflt_cache_init(void);
+void cflt_cache_deinit(void);
+int cflt_cache_get(struct cflt_block*, char*);
+void cflt_cache_add(struct cflt_block*, char*, unsigned int);
+void cflt_cache_del(struct cflt_block*);
+int cflt_cache_enabled(void);
+int cflt_cache_size_set(unsigned long int);
+int cflt_cache_size_get(char*, int);
+
+// readahead.c
+int cflt_ra_init(void);
+void cflt_ra_deinit(void);
+void cflt_ra_read(struct file*, struct cflt_file*, loff_t, size_t);
+void cflt_ra_flush(void);
+int cflt_ra_blocks_set(unsigned long int);
+int cflt_ra_blocks_get(char*, int);
+
+// writeback.c
+int cflt_wb_get(struct cflt_block*, char*);
+void cflt_wb_add(struct cflt_block*, char*);
+int cflt_wb_over(void);
+int cflt_wb_flush(struct file*, struct cflt_file*);
+void cflt_wb_drop(struct cflt_file*);
+int cflt_wb_size_set(unsigned long int);
+int cflt_wb_size_get(char*, int);
+
+// mmap.c
+int cflt_mmap(struct file*, struct vm_area_struct*);
+
+// buffer.c
+char *cflt_buf_get(struct cflt_file*, int);
+void cflt_buf_put(char*);
+unsigned long cflt_buf_size(char*);
+void cflt_buf_init(void);
+void cflt_buf_deinit(void);
 
 // sysfs.c
 int cflt_sysfs_init(void);
 void cflt_sysfs_deinit(void);
 
-// privd.c
-int cflt_privd_cache_init(void);
-void cflt_privd_cache_deinit(void);
-struct cflt_privd *cflt_privd_init(struct cflt_file*);
-struct cflt_privd *cflt_privd_from_rfs(struct rfs_priv_data*);
-
 // debug.c
 #ifdef CFLT_DEBUG
         #define cflt_debug_printk printk
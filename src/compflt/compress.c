@@ -1,15 +1,66 @@
 #include <linux/crypto.h>
+#include <linux/slab.h>
+#include <linux/cpumask.h>
+#include <linux/fs.h>
 #include "compflt.h"
 
 // cryptoapi doesnt provide a way to iterate over all registered methods.
-char *cflt_method_known[] = { "", "deflate", "lzf", "bzip2", "rle", "null", NULL };
+// The index is stored in the file header, new methods have to be appended.
+char *cflt_method_known[] = { "", "deflate", "lzf", "bzip2", "rle", "null",
+        "lz4", "lz4hc", "zstd", NULL };
 unsigned int cflt_cmethod = 0;
+static unsigned int cflt_min_saving = CFLT_DEFAULT_MIN_SAVING;
 
-struct crypto_comp *cflt_comp_init(unsigned int mid)
+#define CFLT_METHOD_CNT (ARRAY_SIZE(cflt_method_known) - 1)
+
+// Allocating a transform sets up the whole compression context (deflate
+// allocates its workspace), so transforms are kept in a per-method pool and
+// reused. The pool grows up to the number of cpus, further users wait for an
+// idle transform.
+struct cflt_tfm_pool {
+        struct list_head idle;
+        unsigned int cnt; // all transforms allocated for the method
+        spinlock_t lock;
+        wait_queue_head_t wait;
+};
+
+static struct cflt_tfm_pool cflt_tfm_pools[CFLT_METHOD_CNT];
+
+void cflt_comp_pools_init(void)
+{
+        int i;
+
+        for (i = 0; i < CFLT_METHOD_CNT; i++) {
+                INIT_LIST_HEAD(&cflt_tfm_pools[i].idle);
+                cflt_tfm_pools[i].cnt = 0;
+                spin_lock_init(&cflt_tfm_pools[i].lock);
+                init_waitqueue_head(&cflt_tfm_pools[i].wait);
+        }
+}
+
+void cflt_comp_pools_deinit(void)
 {
-        struct crypto_comp *tfm = NULL;
+        struct cflt_tfm *ct;
+        struct cflt_tfm *tmp;
+        int i;
 
-        cflt_debug_printk("compflt: [f:comp_init]\n");
+        cflt_debug_printk("compflt: [f:comp_pools_deinit]\n");
+
+        for (i = 0; i < CFLT_METHOD_CNT; i++) {
+                list_for_each_entry_safe(ct, tmp, &cflt_tfm_pools[i].idle, list) {
+                        list_del(&ct->list);
+                        crypto_free_comp(ct->tfm);
+                        kfree(ct);
+                }
+                cflt_tfm_pools[i].cnt = 0;
+        }
+}
+
+static struct cflt_tfm *cflt_comp_alloc(unsigned int mid)
+{
+        struct cflt_tfm *ct;
+
+        cflt_debug_printk("compflt: [f:comp_alloc]\n");
 
         // initialize compression method
         if (!crypto_has_alg(cflt_method_known[mid], 0, 0)) {
@@ -18,19 +69,80 @@ struct crypto_comp *cflt_comp_init(unsigned int mid)
                 return NULL;
         }
 
-        tfm = crypto_alloc_comp(cflt_method_known[mid], 0, 0);
-        if (tfm == NULL) {
+        ct = kmalloc(sizeof(struct cflt_tfm), GFP_KERNEL);
+        if (!ct)
+                return NULL;
+
+        ct->tfm = crypto_alloc_comp(cflt_method_known[mid], 0, 0);
+        if (IS_ERR(ct->tfm) || ct->tfm == NULL) {
                 printk(KERN_ERR "compflt: failed to alloc %s "
                                 "compression method\n", cflt_method_known[mid]);
+                kfree(ct);
                 return NULL;
         }
 
-        return tfm;
+        INIT_LIST_HEAD(&ct->list);
+        ct->mid = mid;
+
+        return ct;
+}
+
+// get an idle transform for method @mid, it has to be returned by
+// cflt_comp_put
+struct cflt_tfm *cflt_comp_get(unsigned int mid)
+{
+        struct cflt_tfm_pool *pool;
+        struct cflt_tfm *ct;
+
+        if (!mid || mid >= CFLT_METHOD_CNT)
+                return NULL;
+
+        pool = &cflt_tfm_pools[mid];
+
+        for (;;) {
+                spin_lock(&pool->lock);
+
+                if (!list_empty(&pool->idle)) {
+                        ct = list_entry(pool->idle.next, struct cflt_tfm, list);
+                        list_del_init(&ct->list);
+                        spin_unlock(&pool->lock);
+                        return ct;
+                }
+
+                if (pool->cnt < num_online_cpus()) {
+                        pool->cnt++;
+                        spin_unlock(&pool->lock);
+
+                        ct = cflt_comp_alloc(mid);
+                        if (!ct) {
+                                spin_lock(&pool->lock);
+                                pool->cnt--;
+                                spin_unlock(&pool->lock);
+                        }
+
+                        return ct;
+                }
+
+                spin_unlock(&pool->lock);
+
+                wait_event(pool->wait, !list_empty(&pool->idle));
+        }
 }
 
-inline void cflt_comp_deinit(struct crypto_comp *tfm)
+void cflt_comp_put(struct cflt_tfm *ct)
 {
-        crypto_free_comp(tfm);
+        struct cflt_tfm_pool *pool;
+
+        if (!ct)
+                return;
+
+        pool = &cflt_tfm_pools[ct->mid];
+
+        spin_lock(&pool->lock);
+        list_add(&ct->list, &pool->idle);
+        spin_unlock(&pool->lock);
+
+        wake_up(&pool->wait);
 }
 
 int cflt_decomp_block(struct crypto_comp *tfm, struct cflt_block *blk)
@@ -39,11 +151,8 @@ int cflt_decomp_block(struct crypto_comp *tfm, struct cflt_block *blk)
 
         cflt_debug_printk("compflt: [f:decomp_block]\n");
 
-	memset(blk->data_u, 0, blk->par->blksize);
-
 	if ((rv = crypto_comp_decompress(tfm, blk->data_c, blk->size_c, blk->data_u, &blk->size_u))) {
                 printk(KERN_ERR "compflt: failed to decompress data block error: %i\n", rv);
-                kfree(blk->data_u);
                 return rv;
         }
 
@@ -52,32 +161,86 @@ int cflt_decomp_block(struct crypto_comp *tfm, struct cflt_block *blk)
         return rv;
 }
 
+// store @blk uncompressed
+static void cflt_comp_raw(struct cflt_block *blk)
+{
+        struct cflt_file *fh = blk->par;
+
+        if (blk->type != CFLT_BLK_RAW)
+                atomic_set(&blk->dirty, 1);
+
+        blk->type = CFLT_BLK_RAW;
+        blk->size_c = blk->size_u;
+
+        fh->raw_run++;
+}
+
+// Compress @blk into blk->data_c (CFLT_BUF_C). Blocks that do not shrink by at least
+// cflt_min_saving % are stored raw (CFLT_BLK_RAW) instead. After
+// CFLT_RAW_SKIP raw blocks in a row, the data of the file is taken for
+// incompressible and only every CFLT_RAW_PROBE-th block is still tried.
+// Raw blocks are used in format 2 files only, older compflt versions reading
+// format 1 files do not know them.
 int cflt_comp_block(struct crypto_comp *tfm, struct cflt_block *blk)
 {
+        struct cflt_file *fh = blk->par;
+        int raw = fh->fmt == 2;
         int rv = 0;
         unsigned int size_c;
+        unsigned int size_max;
 
         cflt_debug_printk("compflt: [f:comp_block]\n");
 
-        size_c = 2*blk->par->blksize;
-        blk->data_c = kmalloc(size_c, GFP_KERNEL);
-        if (!blk->data_c)
-                return -ENOMEM;
+        if (raw && fh->raw_run >= CFLT_RAW_SKIP && fh->raw_run % CFLT_RAW_PROBE) {
+                cflt_debug_printk("compflt: [f:comp_block] skipped\n");
+                cflt_comp_raw(blk);
+                return 0;
+        }
+
+        size_max = blk->size_u * (100 - cflt_min_saving) / 100;
+        if (size_max >= blk->size_u)
+                size_max = blk->size_u - 1;
 
-	memset(blk->data_c, 0, size_c);
+        size_c = 2*blk->par->blksize;
         if ((rv = crypto_comp_compress(tfm, blk->data_u, blk->size_u, blk->data_c, &size_c))) {
                 printk(KERN_ERR "compflt: failed to compress data block error: %i\n", rv);
-                kfree(blk->data_c);
                 return rv;
         }
 
         cflt_debug_printk("compflt: [f:comp_block] compressed %i bytes | ratio=%i:%i\n", blk->size_u, size_c, blk->size_u);
 
+        if (raw && (!blk->size_u || size_c > size_max)) {
+                cflt_comp_raw(blk);
+                return 0;
+        }
+
+        if (blk->type != CFLT_BLK_NORM)
+                atomic_set(&blk->dirty, 1);
+
+        blk->type = CFLT_BLK_NORM;
         blk->size_c = size_c;
+        fh->raw_run = 0;
 
         return rv;
 }
 
+int cflt_comp_min_saving_set(unsigned long int new)
+{
+        if (new < 100) {
+                cflt_min_saving = new;
+                printk(KERN_INFO "compflt: minimal saving set to %li%%\n", new);
+        }
+
+        return 0;
+}
+
+int cflt_comp_min_saving_get(char* buf, int bsize)
+{
+        int len = 0;
+        len = sprintf(buf, "%i\n", cflt_min_saving);
+        return len;
+}
+
 int cflt_comp_method_get(char* buf, int bsize)
 {
         int len = 0;
@@ -89,26 +252,195 @@ int cflt_comp_method_get(char* buf, int bsize)
         return len;
 }
 
+// index of the method called @name (@len chars) or 0 if unknown
+static unsigned int cflt_comp_method_find(const char *name, int len)
+{
+        unsigned int i;
+
+        for (i = 1; i < CFLT_METHOD_CNT; i++) {
+                if (strlen(cflt_method_known[i]) == len &&
+                    !strncmp(cflt_method_known[i], name, len))
+                        return i;
+        }
+
+        return 0;
+}
+
 int cflt_comp_method_set(const char* buf)
 {
-        char **p = cflt_method_known;
-        int i = 1;
+        unsigned int i = cflt_comp_method_find(buf, strlen(buf));
 
-        p++; // skip 1st 'dummy' entry
-        while (*p) {
-                if (!strcmp(*p, buf) && strlen(*p) == strlen(buf)) {
-                        if (crypto_has_alg(*p, 0, 0)) {
-                                cflt_cmethod = i;
-                                printk(KERN_INFO "compflt: compression method set to '%s'\n", *p);
-                                return 0;
-                        }
-                        else {
-                                printk(KERN_INFO "compflt: compression method '%s' unavailable\n", *p);
-                        }
+        if (!i)
+                return -1;
+
+        if (!crypto_has_alg(cflt_method_known[i], 0, 0)) {
+                printk(KERN_INFO "compflt: compression method '%s' unavailable\n", cflt_method_known[i]);
+                return -1;
+        }
+
+        // have one transform ready for the first read or write
+        cflt_comp_put(cflt_comp_get(i));
+        cflt_cmethod = i;
+        printk(KERN_INFO "compflt: compression method set to '%s'\n", cflt_method_known[i]);
+
+        return 0;
+}
+
+// Files created under a path can use another method than cflt_cmethod, e.g.
+// lz4 for hot data and zstd for archives. The method is stored in the file
+// header, so every file is read with the method it was written with.
+struct cflt_rule {
+        struct list_head list;
+        unsigned int mid;
+        int len;
+        char path[0];
+};
+
+static LIST_HEAD(cflt_rules);
+static DEFINE_SPINLOCK(cflt_rules_l);
+
+// method for a new file @f, the rule with the longest matching path wins
+unsigned int cflt_comp_method_for(struct file *f)
+{
+        struct cflt_rule *rule;
+        unsigned int mid = cflt_cmethod;
+        int best = -1;
+        char *buf;
+        char *path;
+
+        if (list_empty(&cflt_rules))
+                return mid;
+
+        buf = (char *)__get_free_page(GFP_KERNEL);
+        if (!buf)
+                return mid;
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,25)
+        path = d_path(f->f_dentry, f->f_vfsmnt, buf, PAGE_SIZE);
+#else
+        path = d_path(&f->f_path, buf, PAGE_SIZE);
+#endif
+        if (IS_ERR(path))
+                goto end;
+
+        spin_lock(&cflt_rules_l);
+        list_for_each_entry(rule, &cflt_rules, list) {
+                if (rule->len <= best || strncmp(path, rule->path, rule->len))
+                        continue;
+
+                if (path[rule->len] != '/' && path[rule->len])
+                        continue;
+
+                best = rule->len;
+                mid = rule->mid;
+        }
+        spin_unlock(&cflt_rules_l);
+
+        cflt_debug_printk("compflt: [f:comp_method_for] %s: %s\n", path, cflt_method_known[mid]);
+end:
+        free_page((unsigned long)buf);
+        return mid;
+}
+
+// "<method>:<path>" sets the method for files created under path,
+// ":<path>" removes the rule
+int cflt_comp_rule_set(const char *buf, size_t size)
+{
+        struct cflt_rule *rule;
+        struct cflt_rule *old = NULL;
+        const char *path;
+        unsigned int mid = 0;
+        int len;
+
+        if (size && buf[size-1] == '\n')
+                size--;
+
+        path = memchr(buf, ':', size);
+        if (!path)
+                return -EINVAL;
+
+        if (path != buf) {
+                mid = cflt_comp_method_find(buf, path - buf);
+                if (!mid || !crypto_has_alg(cflt_method_known[mid], 0, 0)) {
+                        printk(KERN_INFO "compflt: compression method '%.*s' unavailable\n", (int)(path - buf), buf);
+                        return -EINVAL;
+                }
+        }
+
+        path++;
+        len = buf + size - path;
+        if (!len || *path != '/')
+                return -EINVAL;
+
+        // "/dir/" and "/dir" are the same, "/" matches everything
+        while (len && path[len-1] == '/')
+                len--;
+
+        rule = kmalloc(sizeof(struct cflt_rule) + len + 1, GFP_KERNEL);
+        if (!rule)
+                return -ENOMEM;
+
+        memcpy(rule->path, path, len);
+        rule->path[len] = 0;
+        rule->len = len;
+        rule->mid = mid;
+
+        spin_lock(&cflt_rules_l);
+        list_for_each_entry(old, &cflt_rules, list) {
+                if (old->len == len && !memcmp(old->path, rule->path, len)) {
+                        list_del(&old->list);
                         break;
                 }
-                p++; i++;
         }
+        if (&old->list == &cflt_rules)
+                old = NULL;
+
+        if (mid)
+                list_add_tail(&rule->list, &cflt_rules);
+        spin_unlock(&cflt_rules_l);
+
+        if (mid) {
+                // have one transform ready for the first write
+                cflt_comp_put(cflt_comp_get(mid));
+                printk(KERN_INFO "compflt: compression method for '%s/' set to '%s'\n", rule->path, cflt_method_known[mid]);
+        }
+        else
+                kfree(rule);
+
+        kfree(old);
 
-        return -1;
+        return 0;
+}
+
+int cflt_comp_rules_get(char *buf, int bsize)
+{
+        struct cflt_rule *rule;
+        int len = 0;
+
+        spin_lock(&cflt_rules_l);
+        list_for_each_entry(rule, &cflt_rules, list) {
+                len += snprintf(buf + len, bsize - len, "%s:%s\n",
+                                cflt_method_known[rule->mid],
+                                rule->len ? rule->path : "/");
+                if (len >= bsize) {
+                        len = bsize;
+                        break;
+                }
+        }
+        spin_unlock(&cflt_rules_l);
+
+        return len;
+}
+
+void cflt_comp_rules_clear(void)
+{
+        struct cflt_rule *rule;
+        struct cflt_rule *tmp;
+
+        spin_lock(&cflt_rules_l);
+        list_for_each_entry_safe(rule, tmp, &cflt_rules, list) {
+                list_del(&rule->list);
+                kfree(rule);
+        }
+        spin_unlock(&cflt_rules_l);
 }
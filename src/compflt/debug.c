@@ -12,10 +12,10 @@ void cflt_debug_block(struct cflt_block *blk)
 
 void cflt_debug_file_header(struct cflt_file *fh)
 {
-        printk("[file] ino=%li compressed=%i dirty=%i method=%i blksize=%i size=%i\n",
+        printk("[file] ino=%li compressed=%i dirty=%i method=%i blksize=%i size=%i fmt=%i idx=%i@%i\n",
                         fh->inode->i_ino, atomic_read(&fh->compressed),
                         atomic_read(&fh->dirty), fh->method, fh->blksize,
-                        (int)fh->size_u);
+                        (int)fh->size_u, fh->fmt, fh->cnt_idx, fh->off_idx);
 }
 
 void cflt_debug_file(struct cflt_file *fh)
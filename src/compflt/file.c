@@ -10,11 +10,15 @@ static struct kmem_cache *cflt_file_cache = NULL;
 atomic_t file_cache_cnt;
 wait_queue_head_t file_cache_w;
 
-struct list_head cflt_file_list;
-spinlock_t cflt_file_list_l = SPIN_LOCK_UNLOCKED;
-
 static unsigned int cflt_blksize = CFLT_DEFAULT_BLKSIZE;
+static unsigned int cflt_compact = CFLT_DEFAULT_COMPACT;
+static atomic_t cflt_wasted = ATOMIC_INIT(0); // bytes in free blocks of all files
 
+// size of the file header, the first block follows it
+static inline unsigned int cflt_file_hsize(struct cflt_file *fh)
+{
+        return fh->fmt == 1 ? CFLT_FH_SIZE : CFLT_FH_IDX_SIZE;
+}
 
 void cflt_file_truncate(struct cflt_file *fh)
 {
@@ -23,22 +27,64 @@ void cflt_file_truncate(struct cflt_file *fh)
         fh->size_u = 0;
         fh->method = cflt_cmethod;
         fh->blksize = cflt_blksize;
+        fh->fmt = 2;
+        fh->off_idx = fh->cnt_idx = 0;
+        fh->raw_run = 0;
         atomic_set(&fh->dirty, 0);
         atomic_set(&fh->compressed, 0);
 }
 
-// deinit all block belonging to this file
-inline void cflt_file_clr_blks(struct cflt_file *fh)
+// free all blocks of @fh, nothing may use them anymore
+static void cflt_file_drop_blks(struct cflt_file *fh)
 {
         struct cflt_block *blk;
         struct cflt_block *tmp;
 
-        cflt_debug_printk("compflt: [f:cflt_file_clr_blks]\n");
+        cflt_wb_drop(fh);
 
         list_for_each_entry_safe(blk, tmp, &fh->blks, file) {
                 list_del(&blk->file);
                 cflt_block_deinit(blk);
         }
+        fh->idx = RB_ROOT;
+        fh->pos = RB_ROOT;
+        fh->free = RB_ROOT;
+
+        atomic_sub(fh->wasted, &cflt_wasted);
+        fh->wasted = 0;
+}
+
+// deinit all block belonging to this file
+void cflt_file_clr_blks(struct cflt_file *fh)
+{
+        cflt_debug_printk("compflt: [f:cflt_file_clr_blks]\n");
+
+        // readahead works reference blocks
+        cflt_ra_flush();
+
+        cflt_file_drop_blks(fh);
+}
+
+static inline struct cflt_file *cflt_file_from_rfs(struct redirfs_data *rfs_data)
+{
+        return container_of(rfs_data, struct cflt_file, rfs_data);
+}
+
+// called by redirfs when the last reference to the file is dropped. Readahead
+// works hold a reference, so no block is used anymore.
+static void cflt_file_free(struct redirfs_data *rfs_data)
+{
+        struct cflt_file *fh = cflt_file_from_rfs(rfs_data);
+
+        cflt_debug_printk("compflt: [f:cflt_file_free] i=%li\n", fh->inode->i_ino);
+
+        cflt_file_drop_blks(fh);
+
+        kmem_cache_free(cflt_file_cache, fh);
+
+        if(atomic_dec_and_test(&file_cache_cnt)) {
+                wake_up_interruptible(&file_cache_w);
+        }
 }
 
 // alloc and initialize a (struct cflt_file)
@@ -53,59 +99,37 @@ static struct cflt_file* cflt_file_init(struct inode *inode)
                 printk(KERN_ERR "compflt: failed to alloc file header\n");
                 return NULL;
         }
+
+        if (redirfs_init_data(&fh->rfs_data, compflt, cflt_file_free, NULL)) {
+                kmem_cache_free(cflt_file_cache, fh);
+                return NULL;
+        }
         atomic_inc(&file_cache_cnt);
 
         INIT_LIST_HEAD(&fh->blks);
+        INIT_LIST_HEAD(&fh->wb);
+        fh->idx = RB_ROOT;
+        fh->pos = RB_ROOT;
+        fh->free = RB_ROOT;
+        fh->wasted = 0;
 
-        init_waitqueue_head(&fh->ref_w);
         spin_lock_init(&fh->lock);
-        atomic_set(&fh->cnt, 0);
+        init_rwsem(&fh->layout);
+        fh->locked = NULL;
         atomic_set(&fh->dirty, 0);
         atomic_set(&fh->compressed, 0);
         fh->inode = inode;
         fh->size_u = 0;
+        fh->ra_next = 0;
         fh->method = cflt_cmethod;
         fh->blksize = cflt_blksize;
-
-        spin_lock(&cflt_file_list_l);
-        list_add(&(fh->all), &(cflt_file_list));
-        spin_unlock(&cflt_file_list_l);
+        fh->fmt = 2;
+        fh->off_idx = fh->cnt_idx = 0;
+        fh->raw_run = 0;
 
         return fh;
 }
 
-// dealloc a (struct cflt_file) and remove from master file list
-static void cflt_file_deinit(struct cflt_file *fh)
-{
-	unsigned long flags;
-
-        cflt_debug_printk("compflt: [f:cflt_file_deinit] i=%li\n", fh->inode->i_ino);
-
-        wait_event_interruptible(fh->ref_w, !atomic_read(&fh->cnt));
-
-        //TODO: irqsave not needed anymore ? (doesnt get called from the rfs
-        // callback now)
-        spin_lock_irqsave(&cflt_file_list_l, flags);
-        list_del(&fh->all);
-        spin_unlock_irqrestore(&cflt_file_list_l, flags);
-
-        cflt_file_clr_blks(fh);
-
-        kmem_cache_free(cflt_file_cache, fh);
-
-        if(atomic_dec_and_test(&file_cache_cnt)) {
-                wake_up_interruptible(&file_cache_w);
-        }
-}
-
-/*
-// callback registered with redirfs
-static inline void cflt_file_deinit_cb(void *data)
-{
-        cflt_file_deinit((struct cflt_file*)data);
-}
-*/
-
 int cflt_file_cache_init(void)
 {
         cflt_debug_printk("compflt: [f:cflt_file_cache_init]\n");
@@ -122,45 +146,187 @@ int cflt_file_cache_init(void)
         init_waitqueue_head(&file_cache_w);
         atomic_set(&file_cache_cnt, 0);
 
-        INIT_LIST_HEAD(&cflt_file_list);
-
         return 0;
 }
 
+// the uncompressed size is the end of the block with the highest off_u
 static void cflt_file_update_size(struct cflt_file *fh)
 {
         struct cflt_block *blk;
+        struct rb_node *last;
 
         spin_lock(&fh->lock);
         fh->size_u = 0;
-        list_for_each_entry(blk, &fh->blks, file) {
-                fh->size_u += blk->size_u;
+        last = rb_last(&fh->idx);
+        if (last) {
+                blk = rb_entry(last, struct cflt_block, idx);
+                fh->size_u = blk->off_u + blk->size_u;
         }
         spin_unlock(&fh->lock);
 }
 
+// the files are freed once redirfs drops the data attached to the inodes
 void cflt_file_cache_deinit(void)
 {
-        struct cflt_file *fh;
-        struct cflt_file *tmp;
-
         cflt_debug_printk("compflt: [f:cflt_file_cache_deinit]\n");
 
-        list_for_each_entry_safe(fh, tmp, &cflt_file_list, all) {
-                cflt_file_deinit(fh);
-        }
-
         wait_event_interruptible(file_cache_w, !atomic_read(&file_cache_cnt));
         kmem_cache_destroy(cflt_file_cache);
 }
 
-// Add the block to the right spot in the blks list after it was moved within
-// the file (cflt_file_place_old_blk)
-// @blk: block to (re)place in the list
-static void cflt_file_readd_blk(struct cflt_block *blk)
+// Add a normal block to the @fh->idx tree ordered by off_u
+void cflt_file_idx_add(struct cflt_file *fh, struct cflt_block *blk)
 {
-        list_del(&blk->file);
-        cflt_file_add_blk(blk->par, blk);
+        struct rb_node **p = &fh->idx.rb_node;
+        struct rb_node *parent = NULL;
+        struct cflt_block *aux;
+
+        while (*p) {
+                parent = *p;
+                aux = rb_entry(parent, struct cflt_block, idx);
+
+                if (blk->off_u < aux->off_u)
+                        p = &parent->rb_left;
+                else
+                        p = &parent->rb_right;
+        }
+
+        rb_link_node(&blk->idx, parent, p);
+        rb_insert_color(&blk->idx, &fh->idx);
+}
+
+// Free blocks are kept in the @fh->free tree ordered by size_c (they use the
+// idx node, which only normal blocks need otherwise)
+static void cflt_file_free_add(struct cflt_file *fh, struct cflt_block *blk)
+{
+        struct rb_node **p = &fh->free.rb_node;
+        struct rb_node *parent = NULL;
+        struct cflt_block *aux;
+
+        while (*p) {
+                parent = *p;
+                aux = rb_entry(parent, struct cflt_block, idx);
+
+                if (blk->size_c < aux->size_c)
+                        p = &parent->rb_left;
+                else
+                        p = &parent->rb_right;
+        }
+
+        rb_link_node(&blk->idx, parent, p);
+        rb_insert_color(&blk->idx, &fh->free);
+
+        fh->wasted += CFLT_BH_SIZE + blk->size_c;
+        atomic_add(CFLT_BH_SIZE + blk->size_c, &cflt_wasted);
+}
+
+static void cflt_file_free_del(struct cflt_file *fh, struct cflt_block *blk)
+{
+        rb_erase(&blk->idx, &fh->free);
+        RB_CLEAR_NODE(&blk->idx);
+
+        fh->wasted -= CFLT_BH_SIZE + blk->size_c;
+        atomic_sub(CFLT_BH_SIZE + blk->size_c, &cflt_wasted);
+}
+
+// move the free block @blk to @off_c and resize it to @size_c
+static void cflt_file_free_set(struct cflt_block *blk, unsigned int off_c, unsigned int size_c)
+{
+        cflt_file_free_del(blk->par, blk);
+        blk->off_c = off_c;
+        blk->size_c = size_c;
+        atomic_set(&blk->dirty, 1);
+        cflt_file_free_add(blk->par, blk);
+}
+
+// Find the smallest free block that can hold a block of @size_c bytes. What
+// remains of the free block has to be empty or big enough for a header.
+static struct cflt_block *cflt_file_free_best(struct cflt_file *fh, unsigned int size_c)
+{
+        struct rb_node *n = fh->free.rb_node;
+        struct cflt_block *best = NULL;
+        struct cflt_block *aux;
+
+        while (n) {
+                aux = rb_entry(n, struct cflt_block, idx);
+
+                if (aux->size_c >= size_c) {
+                        best = aux;
+                        n = n->rb_left;
+                }
+                else
+                        n = n->rb_right;
+        }
+
+        while (best && best->size_c != size_c &&
+               best->size_c < size_c + CFLT_BH_SIZE) {
+                n = rb_next(&best->idx);
+                best = n ? rb_entry(n, struct cflt_block, idx) : NULL;
+        }
+
+        return best;
+}
+
+// block of @fh starting at @off_c, or the last one before it if @before
+static struct cflt_block *cflt_file_pos_find(struct cflt_file *fh, unsigned int off_c, int before)
+{
+        struct rb_node *n = fh->pos.rb_node;
+        struct cflt_block *found = NULL;
+        struct cflt_block *aux;
+
+        while (n) {
+                aux = rb_entry(n, struct cflt_block, pos);
+
+                if (aux->off_c == off_c && !before)
+                        return aux;
+
+                if (aux->off_c < off_c) {
+                        if (before)
+                                found = aux;
+                        n = n->rb_right;
+                }
+                else
+                        n = n->rb_left;
+        }
+
+        return found;
+}
+
+// Find the normal block with the lowest off_u that can overlap with a request
+// starting at @off. Blocks never span more than blksize bytes, so only blocks
+// starting after @off - blksize are of interest.
+// @fh: file to search in
+// @off: start of the request
+struct cflt_block *cflt_file_first_blk(struct cflt_file *fh, loff_t off)
+{
+        struct rb_node *n = fh->idx.rb_node;
+        struct cflt_block *first = NULL;
+        struct cflt_block *aux;
+        loff_t low = off - fh->blksize;
+
+        while (n) {
+                aux = rb_entry(n, struct cflt_block, idx);
+
+                if ((loff_t)aux->off_u > low) {
+                        first = aux;
+                        n = n->rb_left;
+                }
+                else
+                        n = n->rb_right;
+        }
+
+        return first;
+}
+
+// next normal block in off_u order or NULL
+struct cflt_block *cflt_file_next_blk(struct cflt_block *blk)
+{
+        struct rb_node *n = rb_next(&blk->idx);
+
+        if (!n)
+                return NULL;
+
+        return rb_entry(n, struct cflt_block, idx);
 }
 
 // Add @block to @fh->blks list in order of off_c
@@ -168,37 +334,256 @@ static void cflt_file_readd_blk(struct cflt_block *blk)
 // @blk: added block
 void cflt_file_add_blk(struct cflt_file *fh, struct cflt_block *blk)
 {
+        struct rb_node **p = &fh->pos.rb_node;
+        struct rb_node *parent = NULL;
+        struct rb_node *prev;
         struct cflt_block *aux;
-        struct list_head *head = NULL;
 
         cflt_debug_printk("compflt: [f:cflt_file_add_blk] i=%li\n", fh->inode->i_ino);
 
-        head = &fh->blks;
-        list_for_each_entry(aux, &fh->blks, file) {
-                if (aux->off_c > blk->off_c)
-                        head = &aux->file;
+        while (*p) {
+                parent = *p;
+                aux = rb_entry(parent, struct cflt_block, pos);
+
+                if (blk->off_c < aux->off_c)
+                        p = &parent->rb_left;
+                else
+                        p = &parent->rb_right;
         }
 
-        list_add_tail(&blk->file, head);
+        rb_link_node(&blk->pos, parent, p);
+        rb_insert_color(&blk->pos, &fh->pos);
+
+        // the list follows the tree
+        prev = rb_prev(&blk->pos);
+        if (prev)
+                list_add(&blk->file, &rb_entry(prev, struct cflt_block, pos)->file);
+        else
+                list_add(&blk->file, &fh->blks);
 
         blk->par = fh;
+
+        if (blk->type == CFLT_BLK_FREE)
+                cflt_file_free_add(fh, blk);
+        // new written blocks are indexed before they are placed
+        else if (RB_EMPTY_NODE(&blk->idx))
+                cflt_file_idx_add(fh, blk);
 }
 
 void cflt_file_del_blk(struct cflt_block *blk)
 {
         list_del(&blk->file);
+
+        if (!RB_EMPTY_NODE(&blk->pos)) {
+                rb_erase(&blk->pos, &blk->par->pos);
+                RB_CLEAR_NODE(&blk->pos);
+        }
+
+        if (RB_EMPTY_NODE(&blk->idx))
+                return;
+
+        if (blk->type == CFLT_BLK_FREE)
+                cflt_file_free_del(blk->par, blk);
+        else {
+                rb_erase(&blk->idx, &blk->par->idx);
+                RB_CLEAR_NODE(&blk->idx);
+        }
+}
+
+// Format 2 files keep a copy of all block headers in an index following the
+// last block, it is written when the file is synced or released and read
+// with a single read. The block headers are still written and are used when
+// there is no valid index.
+//
+// index entry:
+// +-----------------------------+
+// | T | OFFU | OFFC | SC | SU |
+// +-----------------------------+
+
+// size of the compressed data on disk, compflt never changes i_size (seeks
+// in compressed files are done in pre_llseek)
+static loff_t cflt_file_disk_size(struct file *f)
+{
+        return i_size_read(f->f_dentry->d_inode);
+}
+
+// read the blocks from the index, returns 0 if all of them were read
+static int cflt_file_read_index(struct file *f, struct cflt_file *fh)
+{
+        struct cflt_block *blk;
+        loff_t isize = cflt_file_disk_size(f);
+        loff_t off = fh->off_idx;
+        u64 size;
+        char *buf;
+        char *p;
+        int i;
+
+        cflt_debug_printk("compflt: [f:cflt_file_read_index] %i blocks\n", fh->cnt_idx);
+
+        // the header comes from the disk, the index has to fit the data on it
+        if (fh->off_idx < cflt_file_hsize(fh) || fh->off_idx > isize ||
+            fh->cnt_idx > (isize - fh->off_idx) / CFLT_IE_SIZE)
+                return -EINVAL;
+
+        size = (u64)fh->cnt_idx * CFLT_IE_SIZE;
+        if (size != (size_t)size)
+                return -EINVAL;
+
+        buf = vmalloc(size);
+        if (!buf)
+                return -ENOMEM;
+
+        if (cflt_orig_read(f, buf, size, &off) != size) {
+                vfree(buf);
+                return -EIO;
+        }
+
+        for (i = 0, p = buf; i < fh->cnt_idx; i++, p += CFLT_IE_SIZE) {
+                blk = cflt_block_init();
+                if (!blk)
+                        break;
+
+                memcpy(&blk->type, p, sizeof(u8));
+                memcpy(&blk->off_u, p+1, sizeof(u32));
+                memcpy(&blk->off_c, p+5, sizeof(u32));
+                memcpy(&blk->size_c, p+9, sizeof(u16));
+                memcpy(&blk->size_u, p+11, sizeof(u16));
+
+                if ((blk->type != CFLT_BLK_NORM && blk->type != CFLT_BLK_FREE &&
+                     blk->type != CFLT_BLK_RAW) ||
+                    blk->size_u > fh->blksize || blk->off_c < cflt_file_hsize(fh) ||
+                    blk->off_c + CFLT_BH_SIZE + blk->size_c > fh->off_idx) {
+                        cflt_block_deinit(blk);
+                        break;
+                }
+
+                cflt_file_add_blk(fh, blk);
+        }
+
+        vfree(buf);
+
+        if (i == fh->cnt_idx)
+                return 0;
+
+        cflt_file_clr_blks(fh);
+        return -EINVAL;
+}
+
+// cut the compressed file at @size, the file system frees the space after it
+static int cflt_file_trunc(struct file *f, struct cflt_file *fh, loff_t size)
+{
+        struct dentry *dentry = f->f_dentry;
+        struct iattr ia;
+        int err;
+
+        cflt_debug_printk("compflt: [f:cflt_file_trunc] %i\n", (int)size);
+
+        ia.ia_size = size;
+        ia.ia_valid = ATTR_SIZE | ATTR_MTIME | ATTR_CTIME | ATTR_FILE;
+        ia.ia_file = f;
+
+        if (fh->locked == current)
+                return notify_change(dentry, &ia);
+
+        mutex_lock(&dentry->d_inode->i_mutex);
+        err = notify_change(dentry, &ia);
+        mutex_unlock(&dentry->d_inode->i_mutex);
+
+        return err;
+}
+
+// Remove the index before block data is written. New blocks are placed over
+// it and others move into free space, after a crash the index would describe
+// the old layout. The file is cut first, so a header still pointing to the
+// index finds nothing to read and the block headers are used. The index is
+// written again when the file is synced.
+void cflt_file_idx_invalidate(struct file *f, struct cflt_file *fh)
+{
+        if (fh->fmt != 2 || !fh->off_idx)
+                return;
+
+        // the index is not trusted at least, blocks are read up to it
+        if (cflt_file_trunc(f, fh, fh->off_idx))
+                fh->cnt_idx = 0;
+        else
+                fh->off_idx = fh->cnt_idx = 0;
+
+        atomic_set(&fh->dirty, 1);
+        cflt_file_write(f, fh);
+}
+
+// write the index after the last block
+static void cflt_file_write_index(struct file *f, struct cflt_file *fh)
+{
+        struct cflt_block *blk;
+        unsigned int off_end = cflt_file_hsize(fh);
+        unsigned int cnt = 0;
+        int dirty = 0;
+        loff_t off;
+        size_t size;
+        char *buf;
+        char *p;
+
+        list_for_each_entry(blk, &fh->blks, file) {
+                if (atomic_read(&blk->dirty))
+                        dirty = 1;
+                if (blk->off_c+CFLT_BH_SIZE+blk->size_c > off_end)
+                        off_end = blk->off_c+CFLT_BH_SIZE+blk->size_c;
+                cnt++;
+        }
+
+        if (!dirty && fh->off_idx == off_end && fh->cnt_idx == cnt)
+                return;
+
+        cflt_debug_printk("compflt: [f:cflt_file_write_index] %i blocks at %i\n", cnt, off_end);
+
+        // no index is better than a stale one
+        fh->off_idx = off_end;
+        fh->cnt_idx = 0;
+        atomic_set(&fh->dirty, 1);
+
+        size = cnt * CFLT_IE_SIZE;
+        if (!size)
+                return;
+
+        buf = vmalloc(size);
+        if (!buf)
+                return;
+
+        p = buf;
+        list_for_each_entry(blk, &fh->blks, file) {
+                memcpy(p, &blk->type, sizeof(u8));
+                memcpy(p+1, &blk->off_u, sizeof(u32));
+                memcpy(p+5, &blk->off_c, sizeof(u32));
+                memcpy(p+9, &blk->size_c, sizeof(u16));
+                memcpy(p+11, &blk->size_u, sizeof(u16));
+                p += CFLT_IE_SIZE;
+        }
+
+        off = off_end;
+        if (cflt_orig_write(f, fh, buf, size, &off) == size)
+                fh->cnt_idx = cnt;
+
+        vfree(buf);
 }
 
 // read all block headers from file
 int cflt_file_read_block_headers(struct file *f, struct cflt_file *fh)
 {
         int err = 0;
-        loff_t off = CFLT_FH_SIZE;
+        loff_t off = cflt_file_hsize(fh);
         struct cflt_block *blk;
 
         cflt_debug_printk("compflt: [f:cflt_file_read_block_headers]\n");
 
+        if (fh->cnt_idx && !cflt_file_read_index(f, fh))
+                return 0;
+
         while(!err) {
+                // the index follows the last block
+                if (fh->off_idx && off >= fh->off_idx)
+                        break;
+
                 blk = cflt_block_init();
                 if (!blk) {
                         // TODO: change cflt_block_init prototype to return the error
@@ -231,74 +616,63 @@ void cflt_file_write_block_headers(struct file *f, struct cflt_file *fh)
         //spin_unlock(&fh->lock);
 }
 
-// TODO: change to return int , and move cflt_file to params
-// try to find the cflt_file corresponding to @inode in the cache
-// @inode: inode to match with an cflt_file
+// the cflt_file attached to @inode, a reference is taken
 struct cflt_file *cflt_file_find(struct inode *inode)
 {
-        struct cflt_privd *pd;
-        struct rfs_priv_data *rfs_data;
-        int err;
+        struct redirfs_data *rfs_data;
 
         cflt_debug_printk("compflt: [f:cflt_file_find] i=%li\n", inode->i_ino);
 
-        err = rfs_get_data_inode(compflt, inode, &rfs_data);
-        if (err)
+        rfs_data = redirfs_get_data_inode(compflt, inode);
+        if (!rfs_data)
                 return NULL;
 
-        pd = cflt_privd_from_rfs(rfs_data);
-
-        return pd->fh;
+        return cflt_file_from_rfs(rfs_data);
 }
 
-// if the cflt_file is not in the cache and f is set then try to read it from
-// the file
+// if no cflt_file is attached to @inode and f is set then read it from the
+// file and attach it
 struct cflt_file *cflt_file_get(struct inode *inode, struct file *f)
 {
         struct cflt_file *fh = NULL;
-        struct cflt_privd *pd = NULL;
-        struct rfs_priv_data *exist = NULL;
+        struct cflt_file *new;
+        struct redirfs_data *rfs_data;
 
         cflt_debug_printk("compflt: [f:cflt_file_get] i=%li\n", inode->i_ino);
 
         fh = cflt_file_find(inode);
         if (!fh && f) {
-                fh = cflt_file_init(inode);
-
-                if (!fh)
+                new = cflt_file_init(inode);
+                if (!new)
                         return NULL;
 
-                if (cflt_file_read(f, fh)) {
+                if (cflt_file_read(f, new)) {
                         // not an error (file doesnt exist or not copressed)
                         printk(KERN_ERR "compflt: failed to read file header\n");
-                        cflt_file_deinit(fh);
+                        cflt_file_put(new);
                         return NULL;
                 }
 
-                // TODO: this can fail ... returns NULL atm ?
-                pd = cflt_privd_init(fh);
+                if (atomic_read(&new->compressed))
+                        cflt_file_read_block_headers(f, new);
 
-                rfs_attach_data_inode(compflt, inode, &pd->rfs_data, &exist);
-                if (atomic_read(&fh->compressed))
-                        cflt_file_read_block_headers(f, fh);
+                // returns the cflt_file attached in the meantime if any
+                rfs_data = redirfs_attach_data_inode(compflt, inode, &new->rfs_data);
+                if (rfs_data)
+                        fh = cflt_file_from_rfs(rfs_data);
 
+                cflt_file_put(new);
         }
 
-        if (fh) {
-                atomic_inc(&fh->cnt);
+        if (fh)
                 cflt_file_update_size(fh);
-        }
 
         return fh;
 }
 
 void cflt_file_put(struct cflt_file *fh)
 {
-        BUG_ON(!atomic_read(&fh->cnt));
-
-        if(atomic_dec_and_test(&fh->cnt)) {
-                wake_up_interruptible(&fh->ref_w);
-        }
+        redirfs_put_data(&fh->rfs_data);
 }
 
 
@@ -322,9 +696,36 @@ int cflt_file_blksize_get(char* buf, int bsize)
         return len;
 }
 
+// file header:
+// format 1: | MAGIC | M | BLKS |
+// format 2: | MAGIC_IDX | M | BLKS | OFFI | CNTI |
+int cflt_file_compact_set(unsigned long int new)
+{
+        if (new <= 100) {
+                cflt_compact = new;
+                printk(KERN_INFO "compflt: compaction threshold set to %li%%\n", new);
+        }
+
+        return 0;
+}
+
+int cflt_file_compact_get(char* buf, int bsize)
+{
+        int len = 0;
+        len = sprintf(buf, "%i\n", cflt_compact);
+        return len;
+}
+
+int cflt_file_wasted_get(char* buf, int bsize)
+{
+        int len = 0;
+        len = sprintf(buf, "%i\n", atomic_read(&cflt_wasted));
+        return len;
+}
+
 int cflt_file_read(struct file *f, struct cflt_file *fh)
 {
-        char buf[CFLT_FH_SIZE];
+        char buf[CFLT_FH_IDX_SIZE];
         loff_t off = 0;
         int boff = 0;
         int rv = 0;
@@ -332,7 +733,11 @@ int cflt_file_read(struct file *f, struct cflt_file *fh)
         cflt_debug_printk("compflt: [f:cflt_file_read] i=%li\n", fh->inode->i_ino);
 
         rv = cflt_orig_read(f, buf+boff, sizeof(buf), &off);
-        if(rv < sizeof(CFLT_MAGIC)-1 || memcmp(buf, CFLT_MAGIC, sizeof(CFLT_MAGIC)-1)) {
+        if (rv >= CFLT_FH_SIZE && !memcmp(buf, CFLT_MAGIC, sizeof(CFLT_MAGIC)-1))
+                fh->fmt = 1;
+        else if (rv >= CFLT_FH_IDX_SIZE && !memcmp(buf, CFLT_MAGIC_IDX, sizeof(CFLT_MAGIC_IDX)-1))
+                fh->fmt = 2;
+        else {
                 atomic_set(&fh->dirty, 1);
                 return 0;
         }
@@ -341,24 +746,77 @@ int cflt_file_read(struct file *f, struct cflt_file *fh)
         memcpy(&fh->method, buf+boff, sizeof(u8));
         boff += sizeof(u8);
         memcpy(&fh->blksize, buf+boff, sizeof(u32));
+        boff += sizeof(u32);
+
+        // blocks have to fit the scratch buffers
+        if (fh->blksize < CFLT_BLKSIZE_MIN || fh->blksize > CFLT_BLKSIZE_MAX)
+                return -EINVAL;
+
+        if (fh->fmt == 2) {
+                memcpy(&fh->off_idx, buf+boff, sizeof(u32));
+                boff += sizeof(u32);
+                memcpy(&fh->cnt_idx, buf+boff, sizeof(u32));
+        }
 
         return 0;
 }
 
-struct cflt_block* cflt_file_last_blk(struct cflt_file *fh)
+// end of the last block, where the file grows
+static unsigned int cflt_file_end(struct cflt_file *fh)
 {
-        struct cflt_block *aux;
+        struct cflt_block *last;
 
         if (list_empty(&fh->blks))
-                return NULL;
+                return cflt_file_hsize(fh);
 
-        list_for_each_entry(aux, &fh->blks, file) {
-                if (list_is_last(&aux->file, &fh->blks))
-                        return aux;
+        last = list_entry(fh->blks.prev, struct cflt_block, file);
+        return last->off_c + CFLT_BH_SIZE + last->size_c;
+}
+
+// place @blk at the start of the free block @aux, which shrinks or goes away
+static void cflt_file_take_free(struct cflt_block *aux, struct cflt_block *blk)
+{
+        blk->off_c = aux->off_c;
+        atomic_set(&blk->dirty, 1);
+
+        if (aux->size_c == blk->size_c) {
+                cflt_file_del_blk(aux);
+                cflt_block_deinit(aux);
         }
+        else
+                cflt_file_free_set(aux, aux->off_c + CFLT_BH_SIZE + blk->size_c,
+                                aux->size_c - CFLT_BH_SIZE - blk->size_c);
+}
 
-        BUG();
-        return NULL; // just to shut-up the compiler
+// Turn @len bytes at @off_c, not used by any block now, into a free block.
+// Free neighbours are merged with it. @len has to be at least CFLT_BH_SIZE.
+static void cflt_file_free_extent(struct cflt_file *fh, unsigned int off_c, unsigned int len)
+{
+        struct cflt_block *aux;
+
+        aux = cflt_file_pos_find(fh, off_c + len, 0);
+        if (aux && aux->type == CFLT_BLK_FREE) {
+                len += CFLT_BH_SIZE + aux->size_c;
+                cflt_file_del_blk(aux);
+                cflt_block_deinit(aux);
+        }
+
+        aux = cflt_file_pos_find(fh, off_c, 1);
+        if (aux && aux->type == CFLT_BLK_FREE &&
+            aux->off_c + CFLT_BH_SIZE + aux->size_c == off_c) {
+                cflt_file_free_set(aux, aux->off_c, aux->size_c + len);
+                return;
+        }
+
+        aux = cflt_block_init();
+        if (!aux)
+                return; // the space is lost until the file is compacted
+
+        aux->type = CFLT_BLK_FREE;
+        aux->off_c = off_c;
+        aux->size_c = len - CFLT_BH_SIZE;
+        atomic_set(&aux->dirty, 1);
+        cflt_file_add_blk(fh, aux);
 }
 
 // place a new block in the file (set off_c)
@@ -367,153 +825,97 @@ static int cflt_file_place_new_block(struct cflt_block *new)
 {
         struct cflt_block *aux;
 
-        cflt_debug_printk("--- placing new block ---\n");
-
-        // try to find a free block
-        // TODO: optimize to use the block that has the smallest size difference
-        list_for_each_entry(aux, &new->par->blks, file) {
-                if (aux->type == CFLT_BLK_FREE && aux->size_c > new->size_c) {
-                        cflt_debug_printk("using an existing free block\n");
-
-                        aux->size_c -= new->size_c;
-                        new->off_c = aux->off_c;
-
-                        if (unlikely(aux->size_c)) {
-                                cflt_file_del_blk(aux);
-                                cflt_block_deinit(aux);
-                        }
-                        else { // some free space left
-                                aux->off_c = new->off_c+CFLT_BH_SIZE+new->size_c;
-                                atomic_set(&aux->dirty, 1);
-                        }
-                        atomic_set(&new->dirty, 1);
-                        return 0;
-                }
-        }
-
-        cflt_debug_printk("placing at the end of file\n");
-        aux = cflt_file_last_blk(new->par);
-
-        if (!aux) { // first block
-                cflt_debug_printk("as first block\n");
-                new->off_c = CFLT_FH_SIZE;
-        }
-        else {
-                new->off_c = aux->off_c+CFLT_BH_SIZE+aux->size_c;
+        aux = cflt_file_free_best(new->par, new->size_c);
+        if (aux) {
+                cflt_debug_printk("compflt: [f:place_new_block] free block %i@%i\n", aux->size_c, aux->off_c);
+                cflt_file_take_free(aux, new);
+                return 0;
         }
 
+        new->off_c = cflt_file_end(new->par);
         atomic_set(&new->dirty, 1);
 
-        cflt_debug_printk("--- ^^^^^^^^^^^^^^^^^ ---\n");
-
         return 0;
 }
 
 static int cflt_file_place_old_block(struct cflt_block *blk, unsigned int size_c_old)
 {
         struct cflt_block *aux;
-        struct cflt_block *new;
         struct cflt_file *fh = blk->par;
         int size_diff = blk->size_c - size_c_old;
-        unsigned int off_aux = 0;
-
-        cflt_debug_printk("--- placing old block ---\n");
+        unsigned int off_old;
+        int last = list_is_last(&blk->file, &fh->blks);
 
-        // TODO: merge these too conditions after debug
-        if (unlikely(!size_diff)) {
-                cflt_debug_printk("same size , no action\n");
-        }
-        else if (list_is_last(&blk->file, &fh->blks)) {
-                cflt_debug_printk("last block, no action\n");
-        }
-        else if (size_diff < 0) { // shrink
-                cflt_debug_printk("smaller\n");
-
-                // move it if we cant fit a free block in the free space
-                if (-size_diff <= CFLT_BH_SIZE+1)
-                        goto move;
-
-                // create free block
-                new = cflt_block_init();
-                new->type = CFLT_BLK_FREE;
-                new->off_c = blk->off_c+CFLT_BH_SIZE+blk->size_c;
-                new->size_c = -size_diff;
-                atomic_set(&new->dirty, 1);
-                cflt_file_add_blk(blk->par, new);
-
-                atomic_set(&blk->dirty, 1);
-        }
-        else { // grow
-                cflt_debug_printk("bigger\n");
+        if (!size_diff)
+                return 0;
 
-                // expand if the next block is free and has enough space
-                aux = list_entry(blk->file.next, struct cflt_block, file);
-                if (aux->type == CFLT_BLK_FREE && aux->size_c > size_diff) {
-                        aux->off_c += size_diff;
-                        aux->size_c -= size_diff;
-                        atomic_set(&aux->dirty, 1);
+        if (size_diff < 0) { // shrink
+                // the rest becomes a free block if it can hold a header
+                if (-size_diff >= CFLT_BH_SIZE) {
+                        cflt_file_free_extent(fh, blk->off_c + CFLT_BH_SIZE + blk->size_c, -size_diff);
+                        atomic_set(&blk->dirty, 1);
+                        return 0;
                 }
-                else
-                        goto move;
-        }
 
-        cflt_debug_printk("--- ^^^^^^^^^^^^^^^^^ ---\n");
-        return 0;
+                if (last)
+                        return 0;
 
-move:
-        // move if the previous block is free and has enough space
-        aux = list_entry(blk->file.prev, struct cflt_block, file);
-        if (aux && aux->type == CFLT_BLK_FREE && aux->size_c > size_diff) {
-                cflt_debug_printk("using previous free block\n");
-                blk->off_c -= size_diff;
-                atomic_set(&blk->dirty, 1);
-                aux->size_c -= size_diff;
-                atomic_set(&aux->dirty, 1);
-                goto end;
+                goto move;
         }
 
-        // try to find a suitable free block anywhere
-        list_for_each_entry(aux, &blk->par->blks, file) {
-                if (aux->type == CFLT_BLK_FREE && aux->size_c > blk->size_c) {
-                        cflt_debug_printk("using any free block\n");
-                        aux->size_c = size_c_old;
+        // grow
+        if (last)
+                return 0;
 
-                        off_aux = aux->off_c;
-                        aux->off_c = blk->off_c;
-                        blk->off_c = off_aux;
+        // expand into the next block if it is free and has enough space
+        aux = list_entry(blk->file.next, struct cflt_block, file);
+        if (aux->type == CFLT_BLK_FREE) {
+                if (aux->size_c + CFLT_BH_SIZE == size_diff) {
+                        cflt_file_del_blk(aux);
+                        cflt_block_deinit(aux);
+                        atomic_set(&blk->dirty, 1);
+                        return 0;
+                }
 
+                if (aux->size_c >= size_diff) {
+                        cflt_file_free_set(aux, aux->off_c + size_diff, aux->size_c - size_diff);
                         atomic_set(&blk->dirty, 1);
-                        atomic_set(&aux->dirty, 1);
-                        goto end;
+                        return 0;
                 }
         }
 
-        cflt_debug_printk("moving to the end of file\n");
-
-        // move to the end of the file
-        aux = cflt_file_last_blk(blk->par);
+        // move into the end of the previous block if it is free
+        if (blk->file.prev != &fh->blks) {
+                aux = list_entry(blk->file.prev, struct cflt_block, file);
+                if (aux->type == CFLT_BLK_FREE && aux->size_c >= size_diff) {
+                        cflt_file_free_set(aux, aux->off_c, aux->size_c - size_diff);
+                        blk->off_c -= size_diff;
+                        atomic_set(&blk->dirty, 1);
+                        return 0;
+                }
+        }
 
-        // create free block
-        new = cflt_block_init();
-        new->type = CFLT_BLK_FREE;
-        new->off_c = blk->off_c;
-        new->size_c = size_c_old;
-        atomic_set(&new->dirty, 1);
-        cflt_file_add_blk(blk->par, new);
+move:
+        // best fitting free block or the end of the file
+        off_old = blk->off_c;
+        cflt_file_del_blk(blk);
 
-        blk->off_c = aux->off_c+CFLT_BH_SIZE+aux->size_c;
-        atomic_set(&blk->dirty, 1);
+        aux = cflt_file_free_best(fh, blk->size_c);
+        if (aux)
+                cflt_file_take_free(aux, blk);
+        else {
+                blk->off_c = cflt_file_end(fh);
+                atomic_set(&blk->dirty, 1);
+        }
 
-        cflt_file_readd_blk(blk);
+        cflt_file_add_blk(fh, blk);
+        cflt_file_free_extent(fh, off_old, CFLT_BH_SIZE + size_c_old);
 
-        cflt_debug_file(blk->par);
+        cflt_debug_file(fh);
 
-end:
-        cflt_debug_printk("--- ^^^^^^^^^^^^^^^^^ ---\n");
         return 0;
 }
 
-
 // place the block within the file
 // @blk: block to move with new size_c
 // @size_c_old: blocks' old size_c value
@@ -528,7 +930,7 @@ int cflt_file_place_block(struct cflt_block *blk, unsigned int size_c_old)
 void cflt_file_write(struct file *f, struct cflt_file *fh)
 {
         loff_t off = 0;
-        char buf[CFLT_FH_SIZE];
+        char buf[CFLT_FH_IDX_SIZE];
         int boff = 0;
 
         cflt_debug_printk("compflt: [f:cflt_file_write] i=%li\n", fh->inode->i_ino);
@@ -536,12 +938,245 @@ void cflt_file_write(struct file *f, struct cflt_file *fh)
         if (!atomic_read(&fh->dirty))
                 return;
 
-        memcpy(buf+boff, CFLT_MAGIC, sizeof(CFLT_MAGIC)-1);
+        if (fh->fmt == 1)
+                memcpy(buf+boff, CFLT_MAGIC, sizeof(CFLT_MAGIC)-1);
+        else
+                memcpy(buf+boff, CFLT_MAGIC_IDX, sizeof(CFLT_MAGIC_IDX)-1);
         boff += sizeof(CFLT_MAGIC)-1;
         memcpy(buf+boff, &fh->method, sizeof(u8));
         boff += sizeof(u8);
         memcpy(buf+boff, &fh->blksize, sizeof(u32));
-        cflt_orig_write(f, buf, sizeof(buf), &off);
+        boff += sizeof(u32);
+
+        if (fh->fmt == 2) {
+                memcpy(buf+boff, &fh->off_idx, sizeof(u32));
+                boff += sizeof(u32);
+                memcpy(buf+boff, &fh->cnt_idx, sizeof(u32));
+        }
+
+        cflt_orig_write(f, fh, buf, cflt_file_hsize(fh), &off);
 
         atomic_set(&fh->dirty, 0);
 }
+
+// write the header of a free block of @len bytes, header included, at @off_c
+static int cflt_file_write_free(struct file *f, unsigned int off_c, unsigned int len)
+{
+        struct cflt_block *aux;
+        int err;
+
+        aux = cflt_block_init();
+        if (!aux)
+                return -ENOMEM;
+
+        aux->type = CFLT_BLK_FREE;
+        aux->off_c = off_c;
+        aux->size_c = len - CFLT_BH_SIZE;
+        atomic_set(&aux->dirty, 1);
+
+        err = cflt_block_write_header(f, aux);
+        cflt_block_deinit(aux);
+
+        return err;
+}
+
+// add the free block of @len bytes at @off_c, @dirty unless its header is on
+// the disk
+static void cflt_file_add_free(struct cflt_file *fh, unsigned int off_c, unsigned int len, int dirty)
+{
+        struct cflt_block *aux;
+
+        aux = cflt_block_init();
+        if (!aux)
+                return; // the space is lost until the file is compacted
+
+        aux->type = CFLT_BLK_FREE;
+        aux->off_c = off_c;
+        aux->size_c = len - CFLT_BH_SIZE;
+        atomic_set(&aux->dirty, dirty);
+        cflt_file_add_blk(fh, aux);
+}
+
+// drop the free blocks in front of @blk, the space is described elsewhere
+static void cflt_file_del_free_before(struct cflt_file *fh, struct cflt_block *blk)
+{
+        struct cflt_block *aux;
+
+        while (blk->file.prev != &fh->blks) {
+                aux = list_entry(blk->file.prev, struct cflt_block, file);
+                if (aux->type != CFLT_BLK_FREE)
+                        break;
+
+                cflt_file_del_blk(aux);
+                cflt_block_deinit(aux);
+        }
+}
+
+// Move @blk down to @off, the @gap bytes in front of it are free. The file
+// stays readable by the block headers after each write:
+//  1. one free header at @off covers the gap (free headers in it unlinked)
+//  2. the data is copied into the gap, behind a header's room at @off
+//  3. a free header behind the copy covers the rest of the gap and the old
+//     place of the block, nothing points to it yet
+//  4. the header of the block at @off switches to the new layout
+// The gap has to hold the block and a free header behind it, so nothing read
+// by the chain is written over before the last step.
+static int cflt_file_move_block(struct file *f, struct cflt_block *blk,
+                unsigned int off, unsigned int gap, int merged, char *buf)
+{
+        unsigned int off_old = blk->off_c;
+        loff_t pos;
+        int err;
+
+        if (!merged && (err = cflt_file_write_free(f, off, gap)))
+                return err;
+
+        cflt_file_del_free_before(blk->par, blk);
+
+        pos = off_old + CFLT_BH_SIZE;
+        if (cflt_orig_read(f, buf, blk->size_c, &pos) != blk->size_c)
+                return -EIO;
+
+        pos = off + CFLT_BH_SIZE;
+        if (cflt_orig_write(f, blk->par, buf, blk->size_c, &pos) != blk->size_c)
+                return -EIO;
+
+        err = cflt_file_write_free(f, off + CFLT_BH_SIZE + blk->size_c, gap);
+        if (err)
+                return err;
+
+        // keeps the order, all blocks before are below off
+        blk->off_c = off;
+        atomic_set(&blk->dirty, 1);
+        err = cflt_block_write_header(f, blk);
+        if (err) {
+                blk->off_c = off_old;
+                return err;
+        }
+
+        return 0;
+}
+
+// Move all blocks of @fh to the start of the file one after another and drop
+// the free blocks. Blocks only move towards the start of the file and only
+// into free space they do not overlap (cflt_file_move_block), a block that
+// does not fit the space in front of it stays and the space is kept as a free
+// block. Only format 2 files can be compacted, the index marks where the
+// blocks end. Block reads wait for the compaction (fh->layout).
+static int cflt_file_compact(struct file *f, struct cflt_file *fh)
+{
+        struct cflt_block *blk;
+        struct cflt_block *tmp;
+        unsigned int off = cflt_file_hsize(fh);
+        unsigned int hole = 0; // free header written at off, not in fh->blks
+        unsigned int gap;
+        char *buf;
+        int err = 0;
+
+        cflt_debug_printk("compflt: [f:cflt_file_compact] i=%li wasted=%i\n", fh->inode->i_ino, fh->wasted);
+
+        buf = cflt_buf_get(fh, CFLT_BUF_C);
+        if (!buf)
+                return -ENOMEM;
+
+        // readahead works read from the old offsets, they take fh->layout
+        cflt_ra_flush();
+
+        down_write(&fh->layout);
+
+        cflt_file_idx_invalidate(f, fh);
+
+        // the chain on the disk has to be the one in fh->blks
+        cflt_file_write_block_headers(f, fh);
+
+        list_for_each_entry_safe(blk, tmp, &fh->blks, file) {
+                if (blk->type == CFLT_BLK_FREE)
+                        continue;
+
+                if (blk->off_c == off) {
+                        off += CFLT_BH_SIZE + blk->size_c;
+                        continue;
+                }
+
+                gap = blk->off_c - off;
+
+                if (gap < 2*CFLT_BH_SIZE + blk->size_c ||
+                    gap - CFLT_BH_SIZE > CFLT_FREE_MAX ||
+                    blk->size_c > 2*fh->blksize) {
+                        // stays, the space in front of it remains free
+                        if (hole)
+                                cflt_file_add_free(fh, off, hole, 0);
+                        hole = 0;
+                        off = blk->off_c + CFLT_BH_SIZE + blk->size_c;
+                        continue;
+                }
+
+                err = cflt_file_move_block(f, blk, off, gap, hole == gap, buf);
+                if (err) {
+                        // the block stays, one free block in front of it,
+                        // its header is written with the others
+                        cflt_file_del_free_before(fh, blk);
+                        cflt_file_add_free(fh, off, gap, 1);
+                        break;
+                }
+
+                off += CFLT_BH_SIZE + blk->size_c;
+                hole = gap;
+        }
+
+        // the free blocks after the last block go away with the index
+        if (!err) {
+                list_for_each_entry_safe_reverse(blk, tmp, &fh->blks, file) {
+                        if (blk->type != CFLT_BLK_FREE)
+                                break;
+                        cflt_file_del_blk(blk);
+                        cflt_block_deinit(blk);
+                }
+        }
+
+        up_write(&fh->layout);
+
+        cflt_buf_put(buf);
+        return err;
+}
+
+// write the dirty blocks, the file header and the block headers of @fh,
+// @locked is set when the caller holds i_mutex of the file
+int cflt_file_sync(struct file *f, struct cflt_file *fh, int locked)
+{
+        int compacted = 0;
+        int err;
+
+        cflt_debug_printk("compflt: [f:cflt_file_sync] i=%li\n", fh->inode->i_ino);
+
+        if (locked)
+                fh->locked = current;
+
+        err = cflt_wb_flush(f, fh);
+        if (err)
+                goto out;
+
+        // compaction takes the layout lock before i_mutex, it is left to release
+        if (!locked && fh->fmt == 2 && cflt_compact && fh->wasted &&
+            (u64)fh->wasted * 100 >= (u64)cflt_compact * cflt_file_end(fh) &&
+            (f->f_mode & FMODE_WRITE))
+                compacted = !cflt_file_compact(f, fh);
+
+        if (atomic_read(&fh->compressed)) {
+                // before the block headers, it checks for dirty blocks
+                if (fh->fmt == 2)
+                        cflt_file_write_index(f, fh);
+                cflt_file_write(f, fh);
+                cflt_file_write_block_headers(f, fh);
+        }
+
+        // the blocks moved down, give the space after the index back
+        if (compacted)
+                cflt_file_trunc(f, fh, fh->off_idx + (loff_t)fh->cnt_idx * CFLT_IE_SIZE);
+
+out:
+        if (locked)
+                fh->locked = NULL;
+
+        return err;
+}
@@ -0,0 +1,101 @@
+#include <linux/mm.h>
+#include <linux/highmem.h>
+#include <linux/version.h>
+#include "compflt.h"
+
+// The page cache of a compressed file holds the compressed data, which
+// compflt itself reads and writes through it. Mappings of such files get the
+// decompressed data from the fault handler below instead: each faulted page
+// is a new page filled by cflt_read, so it comes from the write-back buffers
+// and the block cache when possible. The pages are not in the page cache and
+// are never written back, so shared writable mappings are refused. Private
+// mappings (exec, shared libraries) and read-only shared mappings work.
+
+// the decompressed page at @pgoff of the mapped file, NULL after the end of
+// the file or on error
+static struct page *cflt_mmap_page(struct vm_area_struct *vma, pgoff_t pgoff)
+{
+        struct file *f = vma->vm_file;
+        struct cflt_file *fh;
+        struct page *page = NULL;
+        loff_t off = (loff_t)pgoff << PAGE_CACHE_SHIFT;
+        size_t size = PAGE_CACHE_SIZE;
+        char *buf;
+        int err;
+
+        cflt_debug_printk("compflt: [f:cflt_mmap_page] i=%li off=%i\n", f->f_dentry->d_inode->i_ino, (int)off);
+
+        fh = cflt_file_get(f->f_dentry->d_inode, f);
+        if (!fh)
+                return NULL;
+
+        if (off >= fh->size_u)
+                goto end;
+
+        page = alloc_page(GFP_HIGHUSER);
+        if (!page)
+                goto end;
+
+        // the part after the end of the file is zeroed by cflt_read
+        buf = kmap(page);
+        err = cflt_read(f, fh, off, &size, buf);
+        kunmap(page);
+
+        if (err) {
+                __free_page(page);
+                page = NULL;
+        }
+end:
+        cflt_file_put(fh);
+        return page;
+}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,23)
+static struct page *cflt_mmap_nopage(struct vm_area_struct *vma, unsigned long addr, int *type)
+{
+        struct page *page;
+        pgoff_t pgoff;
+
+        pgoff = ((addr - vma->vm_start) >> PAGE_SHIFT) + vma->vm_pgoff;
+        page = cflt_mmap_page(vma, pgoff);
+        if (!page)
+                return NOPAGE_SIGBUS;
+
+        if (type)
+                *type = VM_FAULT_MAJOR;
+
+        return page;
+}
+
+static struct vm_operations_struct cflt_vm_ops = {
+        .nopage = cflt_mmap_nopage,
+};
+#else
+static int cflt_mmap_fault(struct vm_area_struct *vma, struct vm_fault *vmf)
+{
+        vmf->page = cflt_mmap_page(vma, vmf->pgoff);
+        if (!vmf->page)
+                return VM_FAULT_SIGBUS;
+
+        return VM_FAULT_MAJOR;
+}
+
+static struct vm_operations_struct cflt_vm_ops = {
+        .fault = cflt_mmap_fault,
+};
+#endif
+
+// map the compressed file @f, used instead of the mmap operation of the file
+int cflt_mmap(struct file *f, struct vm_area_struct *vma)
+{
+        cflt_debug_printk("compflt: [f:cflt_mmap] i=%li\n", f->f_dentry->d_inode->i_ino);
+
+        // pages written through the mapping would never be compressed
+        if ((vma->vm_flags & VM_SHARED) && (vma->vm_flags & VM_MAYWRITE))
+                return -ENODEV;
+
+        file_accessed(f);
+        vma->vm_ops = &cflt_vm_ops;
+
+        return 0;
+}
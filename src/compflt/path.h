@@ -1,2 +0,0 @@
-// this is separate in order to import it from test/ for example
-#define CFLT_INC_DIR "/root/tmp" // temporary 'solution'
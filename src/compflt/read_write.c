@@ -1,25 +1,31 @@
 #include <linux/crypto.h>
+#include <linux/pagemap.h>
+#include <linux/highmem.h>
 #include <asm/uaccess.h> // get_fs / set_fs
-#include "../redirfs/redir.h"
 #include "compflt.h"
 
+// The compressed data is read and written through the original read and
+// write operations of the file, the ones redirfs replaced. The filters are
+// not called for them, so no filter sees the compressed data and compflt
+// does not see its own calls. They are not called through vfs_read/vfs_write,
+// since headers are read from files opened for writing only as well.
+//
+// The write operation takes i_mutex. When the file is synced by a task that
+// holds it already (fsync before 3.1, fh->locked), the data
+// is written through the page cache of the file instead, the same way the
+// write operation does it.
+
 ssize_t cflt_orig_read(struct file *f, char __user *buf, size_t len, loff_t *off)
 {
         mm_segment_t orig_fs;
         ssize_t rv;
-        union rfs_op_args args;
 
         cflt_debug_printk("compflt: [f:orig_read] %i@%i\n", len, (int)*off);
 
-        args.f_read.file = f;
-        args.f_read.buf = buf;
-        args.f_read.count = len;
-        args.f_read.pos = off;
-
         orig_fs = get_fs();
         set_fs(KERNEL_DS);
 
-        rv = rfs_read_subcall(compflt, &args);
+        rv = redirfs_orig_read(f, buf, len, off);
 
 	set_fs(orig_fs);
 
@@ -28,30 +34,121 @@ ssize_t cflt_orig_read(struct file *f, char __user *buf, size_t len, loff_t *off
         return rv;
 }
 
-ssize_t cflt_orig_write(struct file *f, const char __user *buf, size_t len, loff_t *off)
+static ssize_t cflt_orig_write_fop(struct file *f, const char __user *buf, size_t len, loff_t *off)
 {
 	mm_segment_t orig_fs;
-        int rv;
-        union rfs_op_args args;
-
-	cflt_debug_printk("compflt: [f:orig_write] %i@%i\n", len, (int) *off);
-	cflt_hexdump((char*)buf, len); // DEBUG
-
-        args.f_write.file = f;
-        args.f_write.buf = buf;
-        args.f_write.count = len;
-        args.f_write.pos = off;
+        ssize_t rv;
 
 	orig_fs = get_fs();
 	set_fs(KERNEL_DS);
 
-        rv = rfs_write_subcall(compflt, &args);
+        rv = redirfs_orig_write(f, buf, len, off);
 
 	set_fs(orig_fs);
 
         return rv;
 }
 
+// write @len bytes of @buf at @off into the page cache of @f, i_mutex is held
+static ssize_t cflt_orig_write_locked(struct file *f, const char *buf, size_t len, loff_t *off)
+{
+        struct address_space *mapping = f->f_mapping;
+        struct page *page;
+        unsigned int offset;
+        unsigned int bytes;
+        size_t done = 0;
+        char *kaddr;
+        int rv = 0;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,24)
+        void *fsdata;
+
+        if (!mapping->a_ops->write_begin || !mapping->a_ops->write_end)
+                return -EINVAL;
+#else
+        pgoff_t index;
+
+        if (!mapping->a_ops->prepare_write || !mapping->a_ops->commit_write)
+                return -EINVAL;
+#endif
+
+        while (done < len) {
+                offset = *off & (PAGE_CACHE_SIZE - 1);
+                bytes = min_t(size_t, PAGE_CACHE_SIZE - offset, len - done);
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,24)
+                rv = pagecache_write_begin(f, mapping, *off, bytes,
+                                AOP_FLAG_UNINTERRUPTIBLE, &page, &fsdata);
+                if (rv)
+                        break;
+
+                kaddr = kmap(page);
+                memcpy(kaddr + offset, buf + done, bytes);
+                kunmap(page);
+                flush_dcache_page(page);
+
+                rv = pagecache_write_end(f, mapping, *off, bytes, bytes, page, fsdata);
+                if (rv < 0)
+                        break;
+
+                bytes = rv;
+                rv = 0;
+#else
+                index = *off >> PAGE_CACHE_SHIFT;
+                page = grab_cache_page(mapping, index);
+                if (!page) {
+                        rv = -ENOMEM;
+                        break;
+                }
+
+                rv = mapping->a_ops->prepare_write(f, page, offset, offset + bytes);
+                if (!rv) {
+                        kaddr = kmap(page);
+                        memcpy(kaddr + offset, buf + done, bytes);
+                        kunmap(page);
+                        flush_dcache_page(page);
+
+                        rv = mapping->a_ops->commit_write(f, page, offset, offset + bytes);
+                }
+
+                if (rv == AOP_TRUNCATED_PAGE) {
+                        page_cache_release(page);
+                        rv = 0;
+                        continue;
+                }
+
+                unlock_page(page);
+                page_cache_release(page);
+                if (rv)
+                        break;
+#endif
+                if (!bytes)
+                        break;
+
+                done += bytes;
+                *off += bytes;
+        }
+
+        if (done)
+                return done;
+
+        return rv ? rv : -EIO;
+}
+
+ssize_t cflt_orig_write(struct file *f, struct cflt_file *fh, const char __user *buf, size_t len, loff_t *off)
+{
+        ssize_t rv;
+
+	cflt_debug_printk("compflt: [f:orig_write] %i@%i\n", len, (int) *off);
+	cflt_hexdump((char*)buf, len); // DEBUG
+
+        if (fh->locked == current)
+                rv = cflt_orig_write_locked(f, (const char*)buf, len, off);
+        else
+                rv = cflt_orig_write_fop(f, buf, len, off);
+
+        return rv;
+}
+
 #define cflt_rw_match(blk, off_req, size_req, blk_max) \
         ((blk->off_u <= off_req && (blk->off_u + blk_max) > off_req) || (blk->off_u >= off_req && blk->off_u < off_req + size_req));
 
@@ -110,59 +207,82 @@ static inline void cflt_write_params(struct cflt_block *blk, loff_t req_start, s
 // buff_u is expected to have enough space for size_req bytes
 int cflt_read(struct file *f, struct cflt_file *fh, loff_t off_req, size_t *size_req, char *buff_u)
 {
-        struct crypto_comp *tfm;
+        struct cflt_tfm *ct;
         struct cflt_block *blk;
 
         loff_t off_src;
         loff_t off_dst;
         size_t size;
         size_t size_total = 0;
-        int err;
+        unsigned int ver;
+        char *data_u = NULL;
+        char *data_c = NULL;
+        int err = 0;
 
         cflt_debug_printk("compflt: [f:read_u] i=%li\n", fh->inode->i_ino);
 
         memset(buff_u, 0, *size_req);
 
-        tfm = cflt_comp_init(fh->method);
+        ct = cflt_comp_get(fh->method);
+        if (!ct)
+                return -EINVAL;
+
+        // scratch buffers shared by all the blocks of the request
+        data_u = cflt_buf_get(fh, CFLT_BUF_U);
+        data_c = cflt_buf_get(fh, CFLT_BUF_C);
+        if (!data_u || !data_c) {
+                err = -ENOMEM;
+                goto out;
+        }
 
         //spin_lock(&fh->lock);
-        list_for_each_entry(blk, &fh->blks, file) {
+        for (blk = cflt_file_first_blk(fh, off_req);
+             blk && blk->off_u < off_req + *size_req;
+             blk = cflt_file_next_blk(blk)) {
                 cflt_debug_block(blk);
 
-                if (blk->type == CFLT_BLK_FREE ||
-                    !cflt_read_match(blk, off_req, *size_req))
+                if (!cflt_read_match(blk, off_req, *size_req))
                         continue;
 
                 cflt_debug_printk("compflt: [f:read_u] match\n");
 
-                blk->data_u = kmalloc(blk->par->blksize, GFP_KERNEL);
-                if (!blk->data_u)
-                        return -ENOMEM;
+                if (cflt_wb_get(blk, data_u) && cflt_cache_get(blk, data_u)) {
+                        ver = blk->ver;
+                        blk->data_u = data_u;
+                        blk->data_c = data_c;
+                        err = cflt_block_read(f, blk, ct->tfm);
+                        blk->data_u = blk->data_c = NULL;
+                        if (err)
+                                goto out;
 
-                if ((err = cflt_block_read(f, blk, tfm)))
-                        return err;
+                        cflt_cache_add(blk, data_u, ver);
+                }
 
                 cflt_read_params(blk, off_req, *size_req, &off_src, &off_dst, &size);
                 cflt_debug_printk("compflt: [f:read_u] memcpy %i@%i -> %i\n", size, (int)off_src, (int)off_dst);
 
-                memcpy(buff_u+off_dst, blk->data_u+off_src, size);
-                kfree(blk->data_u);
+                memcpy(buff_u+off_dst, data_u+off_src, size);
                 size_total += size;
         }
         //spin_unlock(&fh->lock);
 
-        cflt_comp_deinit(tfm);
         *size_req = size_total;
-
-        return 0;
+        cflt_ra_read(f, fh, off_req, size_total);
+out:
+        cflt_buf_put(data_c);
+        cflt_buf_put(data_u);
+        cflt_comp_put(ct);
+        return err;
 }
 
 int cflt_write(struct file *f, struct cflt_file *fh, loff_t off_req, size_t *size_req, char *buff_in)
 {
         int err = 0;
 
-        struct crypto_comp *tfm;
+        struct cflt_tfm *ct;
         struct cflt_block *blk = NULL;
+        char *data_u;
+        char *data_c = NULL;
 
         loff_t off_src;
         loff_t off_dst;
@@ -171,31 +291,54 @@ int cflt_write(struct file *f, struct cflt_file *fh, loff_t off_req, size_t *siz
 
         cflt_debug_printk("compflt: [f:write_u] i=%li\n", fh->inode->i_ino);
 
-        tfm = cflt_comp_init(fh->method);
+        ct = cflt_comp_get(fh->method);
+        if (!ct)
+                return -EINVAL;
 
         //spin_lock(&fh->lock);
-        list_for_each_entry(blk, &fh->blks, file) {
-                if (blk->type == CFLT_BLK_FREE)
-                        continue;
-
+        for (blk = cflt_file_first_blk(fh, off_req);
+             blk && blk->off_u < off_req + *size_req;
+             blk = cflt_file_next_blk(blk)) {
                 if (!cflt_write_match(blk, off_req, *size_req))
                         continue;
 
                 cflt_debug_printk("compflt: [f:write_u] match:\n");
                 cflt_debug_block(blk);
 
-                blk->data_u = kmalloc(blk->par->blksize, GFP_KERNEL);
-                if (!blk->data_u)
-                        return -ENOMEM;
-
-                if ((err = cflt_block_read(f, blk, tfm)))
-                        return err;
-
                 cflt_write_params(blk, off_req, *size_req, &off_src, &off_dst, &size);
 
+                if (!blk->wb) {
+                        data_u = cflt_buf_get(fh, CFLT_BUF_U);
+                        if (!data_u) {
+                                err = -ENOMEM;
+                                goto out;
+                        }
+
+                        // a block overwritten as a whole does not have to be read
+                        if ((off_dst || size < blk->size_u) &&
+                            cflt_cache_get(blk, data_u)) {
+                                if (!data_c)
+                                        data_c = cflt_buf_get(fh, CFLT_BUF_C);
+
+                                err = -ENOMEM;
+                                if (data_c) {
+                                        blk->data_u = data_u;
+                                        blk->data_c = data_c;
+                                        err = cflt_block_read(f, blk, ct->tfm);
+                                        blk->data_u = blk->data_c = NULL;
+                                }
+                                if (err) {
+                                        cflt_buf_put(data_u);
+                                        goto out;
+                                }
+                        }
+
+                        cflt_wb_add(blk, data_u);
+                }
+
                 cflt_debug_printk("compflt: [f:write_u] memcpy %i@%i -> %i\n", size, (int)off_src, (int)off_dst);
 
-                memcpy(blk->data_u+off_dst, buff_in+off_src, size);
+                memcpy(blk->wb+off_dst, buff_in+off_src, size);
 
                 size_total -= size;
 
@@ -205,13 +348,6 @@ int cflt_write(struct file *f, struct cflt_file *fh, loff_t off_req, size_t *siz
                         atomic_set(&blk->dirty, 1);
                 }
 
-                // updates blk->size_c
-                if ((err = cflt_block_write(f, blk, tfm))) {
-                        kfree(blk->data_u);
-                        return err;
-                }
-                kfree(blk->data_u);
-
                 atomic_set(&fh->compressed, 1);
         }
         //spin_unlock(&fh->lock);
@@ -220,8 +356,10 @@ int cflt_write(struct file *f, struct cflt_file *fh, loff_t off_req, size_t *siz
                 cflt_debug_printk("compflt: [f:write_u] newblk remaining=%i\n", size_total);
 
                 blk = cflt_block_init();
-                if (!blk)
-                        return -1;
+                if (!blk) {
+                        err = -1;
+                        goto out;
+                }
 
                 blk->off_u = off_req + *size_req - size_total;
                 blk->par = fh; // needs to be set for cflt_write_params
@@ -230,27 +368,33 @@ int cflt_write(struct file *f, struct cflt_file *fh, loff_t off_req, size_t *siz
 
                 cflt_debug_printk("compflt: [f:write_u] memcpy %i@%i -> %i\n", blk->size_u, (int)off_src, (int)off_dst);
 
-                blk->data_u = kmalloc(blk->size_u, GFP_KERNEL);
-                if (!blk->data_u)
-                        return -ENOMEM;
+                data_u = cflt_buf_get(fh, CFLT_BUF_U);
+                if (!data_u) {
+                        cflt_block_deinit(blk);
+                        err = -ENOMEM;
+                        goto out;
+                }
 
-                memcpy(blk->data_u, buff_in+off_src, blk->size_u);
+                memcpy(data_u, buff_in+off_src, blk->size_u);
 
-                // updates blk->size_c
-                if ((err = cflt_block_write(f, blk, tfm))) {
-                        kfree(blk->data_u);
-                        return err;
-                }
-                kfree(blk->data_u);
+                // placed in the file when it is written (cflt_wb_flush)
+                cflt_file_idx_add(fh, blk);
+                cflt_wb_add(blk, data_u);
 
                 atomic_set(&fh->compressed, 1);
-                cflt_file_add_blk(fh, blk);
                 size_total -= blk->size_u;
         }
 
         // size_total *should* be 0 at this point
         *size_req -= size_total;
+out:
+        cflt_buf_put(data_c);
+        cflt_comp_put(ct);
+
+        // after the transform is returned, the flush takes one from the
+        // same pool and would wait for it forever with a single cpu
+        if (!err && cflt_wb_over())
+                err = cflt_wb_flush(f, fh);
 
-        cflt_comp_deinit(tfm);
         return err;
 }
@@ -0,0 +1,196 @@
+#include <linux/slab.h>
+#include <linux/file.h>
+#include <linux/workqueue.h>
+#include "compflt.h"
+
+// When a file is read sequentially, the blocks following the request are
+// read and decompressed in advance into the decompressed block cache. Each
+// block is a separate work item on a per-cpu workqueue, so blocks are
+// decompressed on all cpus in parallel.
+
+struct cflt_ra {
+        struct work_struct work;
+        struct file *f;
+        struct cflt_file *fh;
+        struct cflt_block *blk;
+        unsigned int off_c;
+        unsigned int size_c;
+        unsigned int size_u;
+        unsigned int ver;
+        int raw;
+};
+
+static struct workqueue_struct *cflt_ra_wq = NULL;
+static unsigned int cflt_ra_blocks = CFLT_DEFAULT_RA_BLOCKS;
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20)
+static void cflt_ra_work(void *data)
+{
+        struct cflt_ra *ra = data;
+#else
+static void cflt_ra_work(struct work_struct *work)
+{
+        struct cflt_ra *ra = container_of(work, struct cflt_ra, work);
+#endif
+        struct cflt_block *blk = ra->blk;
+        unsigned int size_u = ra->size_u;
+        loff_t off = ra->off_c + CFLT_BH_SIZE;
+        struct cflt_tfm *ct = NULL;
+        char *data_c = NULL;
+        char *data_u = NULL;
+        ssize_t rv = -EAGAIN;
+
+        cflt_debug_printk("compflt: [f:cflt_ra_work] %i@%i\n", ra->size_c, ra->off_c);
+
+        data_u = cflt_buf_get(ra->fh, CFLT_BUF_U);
+        if (!data_u)
+                goto end;
+
+        if (!ra->raw) {
+                data_c = cflt_buf_get(ra->fh, CFLT_BUF_C);
+                if (!data_c)
+                        goto end;
+        }
+
+        // skipped if a compaction moved the block since it was queued
+        down_read(&ra->fh->layout);
+        if (blk->off_c == ra->off_c)
+                rv = cflt_orig_read(ra->f, ra->raw ? data_u : data_c, ra->size_c, &off);
+        up_read(&ra->fh->layout);
+
+        if (rv != ra->size_c)
+                goto end;
+
+        if (ra->raw)
+                goto add;
+
+        // the transform is not held during the read, synchronous readers
+        // would wait for it
+        ct = cflt_comp_get(ra->fh->method);
+        if (!ct)
+                goto end;
+
+        if (crypto_comp_decompress(ct->tfm, data_c, ra->size_c, data_u, &size_u))
+                goto end;
+
+add:
+        // dropped if the block was written in the meantime
+        cflt_cache_add(blk, data_u, ra->ver);
+
+end:
+        clear_bit(CFLT_BLK_RA, &blk->state);
+        cflt_comp_put(ct);
+        cflt_buf_put(data_c);
+        cflt_buf_put(data_u);
+        fput(ra->f);
+        cflt_file_put(ra->fh);
+        kfree(ra);
+}
+
+static void cflt_ra_block(struct file *f, struct cflt_block *blk)
+{
+        struct cflt_ra *ra;
+
+        if (test_and_set_bit(CFLT_BLK_RA, &blk->state))
+                return;
+
+        ra = kmalloc(sizeof(struct cflt_ra), GFP_KERNEL);
+        if (!ra) {
+                clear_bit(CFLT_BLK_RA, &blk->state);
+                return;
+        }
+
+        get_file(f);
+        redirfs_get_data(&blk->par->rfs_data);
+
+        ra->f = f;
+        ra->fh = blk->par;
+        ra->blk = blk;
+        ra->off_c = blk->off_c;
+        ra->size_c = blk->size_c;
+        ra->size_u = blk->size_u;
+        ra->ver = blk->ver;
+        ra->raw = blk->type == CFLT_BLK_RAW;
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20)
+        INIT_WORK(&ra->work, cflt_ra_work, ra);
+#else
+        INIT_WORK(&ra->work, cflt_ra_work);
+#endif
+        queue_work(cflt_ra_wq, &ra->work);
+}
+
+// called after each read of @size bytes at @off, starts readahead of the
+// blocks following the request if the file is read sequentially
+void cflt_ra_read(struct file *f, struct cflt_file *fh, loff_t off, size_t size)
+{
+        struct cflt_block *blk;
+        loff_t next = fh->ra_next;
+        unsigned int cnt;
+
+        fh->ra_next = off + size;
+
+        // the decompressed blocks would be thrown away without the cache
+        if (off != next || !size || !cflt_ra_blocks || !cflt_cache_enabled())
+                return;
+
+        cflt_debug_printk("compflt: [f:cflt_ra_read] sequential read at %i\n", (int)off);
+
+        cnt = cflt_ra_blocks;
+        for (blk = cflt_file_first_blk(fh, off + size);
+             blk && cnt;
+             blk = cflt_file_next_blk(blk)) {
+                if (blk->off_u < off + size)
+                        continue;
+
+                cnt--;
+
+                if (blk->cache || blk->wb)
+                        continue;
+
+                cflt_ra_block(f, blk);
+        }
+}
+
+// wait for all readahead in progress, blocks can be freed afterwards
+void cflt_ra_flush(void)
+{
+        if (cflt_ra_wq)
+                flush_workqueue(cflt_ra_wq);
+}
+
+int cflt_ra_init(void)
+{
+        cflt_debug_printk("compflt: [f:cflt_ra_init]\n");
+
+        cflt_ra_wq = create_workqueue("compflt");
+        if (!cflt_ra_wq)
+                return -ENOMEM;
+
+        return 0;
+}
+
+void cflt_ra_deinit(void)
+{
+        cflt_debug_printk("compflt: [f:cflt_ra_deinit]\n");
+
+        if (cflt_ra_wq)
+                destroy_workqueue(cflt_ra_wq);
+
+        cflt_ra_wq = NULL;
+}
+
+int cflt_ra_blocks_set(unsigned long int new)
+{
+        cflt_ra_blocks = new;
+        printk(KERN_INFO "compflt: readahead set to %li blocks\n", new);
+
+        return 0;
+}
+
+int cflt_ra_blocks_get(char* buf, int bsize)
+{
+        int len = 0;
+        len = sprintf(buf, "%i\n", cflt_ra_blocks);
+        return len;
+}
@@ -16,10 +16,24 @@ static struct sysfs_ops cflt_settings_sops;
 
 static CFLT_ATTR(method, 0644);
 static CFLT_ATTR(blksize, 0644);
+static CFLT_ATTR(cachesize, 0644);
+static CFLT_ATTR(readahead, 0644);
+static CFLT_ATTR(writeback, 0644);
+static CFLT_ATTR(rules, 0644);
+static CFLT_ATTR(compact, 0644);
+static CFLT_ATTR(wasted, 0444);
+static CFLT_ATTR(minsaving, 0644);
 
 static struct attribute *cflt_settings_attrs[] = {
         &cflt_attr_method,
         &cflt_attr_blksize,
+        &cflt_attr_cachesize,
+        &cflt_attr_readahead,
+        &cflt_attr_writeback,
+        &cflt_attr_rules,
+        &cflt_attr_compact,
+        &cflt_attr_wasted,
+        &cflt_attr_minsaving,
         NULL
 };
 
@@ -33,6 +47,20 @@ static ssize_t cflt_sysfs_settings_show(struct kobject *kobj, struct attribute *
                 len = cflt_comp_method_get(buf, PAGE_SIZE);
         else if (!strcmp(attr->name, "blksize"))
                 len = cflt_file_blksize_get(buf, PAGE_SIZE);
+        else if (!strcmp(attr->name, "cachesize"))
+                len = cflt_cache_size_get(buf, PAGE_SIZE);
+        else if (!strcmp(attr->name, "readahead"))
+                len = cflt_ra_blocks_get(buf, PAGE_SIZE);
+        else if (!strcmp(attr->name, "writeback"))
+                len = cflt_wb_size_get(buf, PAGE_SIZE);
+        else if (!strcmp(attr->name, "rules"))
+                len = cflt_comp_rules_get(buf, PAGE_SIZE);
+        else if (!strcmp(attr->name, "compact"))
+                len = cflt_file_compact_get(buf, PAGE_SIZE);
+        else if (!strcmp(attr->name, "wasted"))
+                len = cflt_file_wasted_get(buf, PAGE_SIZE);
+        else if (!strcmp(attr->name, "minsaving"))
+                len = cflt_comp_min_saving_get(buf, PAGE_SIZE);
         else
                 return -EINVAL;
 
@@ -48,6 +76,18 @@ static ssize_t cflt_sysfs_settings_store(struct kobject *kobj, struct attribute
                 cflt_comp_method_set(buf);
         else if (!strcmp(attr->name, "blksize"))
                 cflt_file_blksize_set(simple_strtol(buf, (char**)NULL, 10));
+        else if (!strcmp(attr->name, "cachesize"))
+                cflt_cache_size_set(simple_strtoul(buf, (char**)NULL, 10));
+        else if (!strcmp(attr->name, "readahead"))
+                cflt_ra_blocks_set(simple_strtoul(buf, (char**)NULL, 10));
+        else if (!strcmp(attr->name, "writeback"))
+                cflt_wb_size_set(simple_strtoul(buf, (char**)NULL, 10));
+        else if (!strcmp(attr->name, "rules"))
+                cflt_comp_rule_set(buf, size);
+        else if (!strcmp(attr->name, "compact"))
+                cflt_file_compact_set(simple_strtoul(buf, (char**)NULL, 10));
+        else if (!strcmp(attr->name, "minsaving"))
+                cflt_comp_min_saving_set(simple_strtoul(buf, (char**)NULL, 10));
 
         return size; // this is ok for now
 }
@@ -58,9 +98,9 @@ int cflt_sysfs_init (void)
 
         cflt_debug_printk("compflt: [f:cflt_sysfs_init]\n");
 
-        err = rfs_get_kobject(compflt, &cflt_root_ko);
-        if (err)
-                return err;
+        cflt_root_ko = redirfs_filter_kobject(compflt);
+        if (!cflt_root_ko)
+                return -EINVAL;
 
         memset(&cflt_settings_ko, 0, sizeof(cflt_settings_ko));
         memset(&cflt_settings_ktype, 0, sizeof(cflt_settings_ktype));
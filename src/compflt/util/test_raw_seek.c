@@ -0,0 +1,130 @@
+// Writes incompressible data, which compflt stores in raw blocks, into a file
+// under <dir> and reads it back after lseek(SEEK_END): the tail of the file
+// from several offsets before the end and then the whole file. compflt has to
+// be loaded and <dir> has to be in one of its paths.
+//
+// build: cc -o test_raw_seek test_raw_seek.c
+// run:   ./test_raw_seek <dir>
+
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#define SIZE 263000 // not a multiple of the block size, the last block is partial
+
+static int read_full(int fd, char *buf, size_t size)
+{
+        ssize_t rv;
+
+        while (size) {
+                rv = read(fd, buf, size);
+                if (rv <= 0)
+                        return -1;
+                buf += rv;
+                size -= rv;
+        }
+
+        return 0;
+}
+
+static int write_file(const char *path, const char *data)
+{
+        int fd;
+        int rv = 0;
+
+        fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+                return -1;
+
+        if (write(fd, data, SIZE) != SIZE)
+                rv = -1;
+
+        if (close(fd))
+                rv = -1;
+
+        return rv;
+}
+
+static int check_tail(int fd, const char *data, char *buf, off_t n)
+{
+        if (lseek(fd, -n, SEEK_END) != SIZE - n) {
+                printf("FAIL: lseek(-%ld, SEEK_END)\n", (long)n);
+                return -1;
+        }
+
+        if (read_full(fd, buf, n) || memcmp(buf, data + SIZE - n, n)) {
+                printf("FAIL: last %ld bytes\n", (long)n);
+                return -1;
+        }
+
+        return 0;
+}
+
+int main(int argc, char *argv[])
+{
+        static const off_t tails[] = {1, 1000, 4096, 10000, SIZE};
+        char path[4096];
+        char *data;
+        char *buf;
+        unsigned int i;
+        int rv = 0;
+        int fd;
+
+        if (argc != 2) {
+                fprintf(stderr, "usage: test_raw_seek <dir>\n");
+                return 2;
+        }
+
+        snprintf(path, sizeof(path), "%s/test_raw_seek.%d", argv[1], (int)getpid());
+
+        data = malloc(SIZE);
+        buf = malloc(SIZE);
+        if (!data || !buf)
+                return 2;
+
+        fd = open("/dev/urandom", O_RDONLY);
+        if (fd < 0 || read_full(fd, data, SIZE))
+                return 2;
+        close(fd);
+
+        if (write_file(path, data)) {
+                perror(path);
+                return 2;
+        }
+
+        fd = open(path, O_RDONLY);
+        if (fd < 0) {
+                perror(path);
+                unlink(path);
+                return 2;
+        }
+
+        if (lseek(fd, 0, SEEK_END) != SIZE) {
+                printf("FAIL: lseek(0, SEEK_END) is not the uncompressed size\n");
+                rv = 1;
+        }
+
+        for (i = 0; i < sizeof(tails) / sizeof(tails[0]); i++) {
+                if (check_tail(fd, data, buf, tails[i]))
+                        rv = 1;
+        }
+
+        if (lseek(fd, 0, SEEK_SET) || read_full(fd, buf, SIZE) ||
+            memcmp(buf, data, SIZE)) {
+                printf("FAIL: whole file after lseek(SEEK_END)\n");
+                rv = 1;
+        }
+
+        close(fd);
+        unlink(path);
+        free(data);
+        free(buf);
+
+        if (!rv)
+                printf("PASS\n");
+
+        return rv;
+}
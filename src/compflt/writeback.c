@@ -0,0 +1,139 @@
+#include <linux/slab.h>
+#include <linux/fs.h>
+#include "compflt.h"
+
+// Written data is not compressed right away. The uncompressed data of each
+// written block is kept in blk->wb and the block is compressed and written to
+// the file once, when the file is flushed or released, or when the
+// dirty data of all files exceeds cflt_wb_max bytes. Many small writes to one
+// block then cost a single compression.
+
+static atomic_t cflt_wb_used = ATOMIC_INIT(0); // bytes
+static unsigned long cflt_wb_max = CFLT_DEFAULT_WB_SIZE;
+
+// copy the dirty data of @blk to @data_u
+// returns 0 if the block is dirty and -ENOENT otherwise
+int cflt_wb_get(struct cflt_block *blk, char *data_u)
+{
+        if (!blk->wb)
+                return -ENOENT;
+
+        memcpy(data_u, blk->wb, blk->size_u);
+
+        return 0;
+}
+
+// mark @blk dirty, @data_u (CFLT_BUF_U) becomes its write-back buffer
+void cflt_wb_add(struct cflt_block *blk, char *data_u)
+{
+        struct cflt_file *fh = blk->par;
+
+        cflt_debug_printk("compflt: [f:cflt_wb_add]\n");
+
+        BUG_ON(blk->wb);
+
+        // the cached data is outdated from now on
+        cflt_cache_del(blk);
+
+        blk->wb = data_u;
+        list_add_tail(&blk->wb_list, &fh->wb);
+        atomic_add(cflt_buf_size(data_u), &cflt_wb_used);
+}
+
+static void cflt_wb_clean(struct cflt_block *blk)
+{
+        list_del_init(&blk->wb_list);
+        atomic_sub(cflt_buf_size(blk->wb), &cflt_wb_used);
+        cflt_buf_put(blk->wb);
+        blk->wb = NULL;
+}
+
+// true if the dirty data of all files should be written
+int cflt_wb_over(void)
+{
+        return atomic_read(&cflt_wb_used) > cflt_wb_max;
+}
+
+// compress and write all dirty blocks of @fh
+// @f: file opened for writing, nothing is written otherwise
+int cflt_wb_flush(struct file *f, struct cflt_file *fh)
+{
+        struct cflt_block *blk;
+        struct cflt_block *tmp;
+        struct cflt_tfm *ct;
+        char *data_c;
+        int new;
+        int err = 0;
+
+        if (list_empty(&fh->wb) || !(f->f_mode & FMODE_WRITE))
+                return 0;
+
+        cflt_debug_printk("compflt: [f:cflt_wb_flush] i=%li\n", fh->inode->i_ino);
+
+        ct = cflt_comp_get(fh->method);
+        if (!ct)
+                return -EINVAL;
+
+        // one compression buffer for all the blocks
+        data_c = cflt_buf_get(fh, CFLT_BUF_C);
+        if (!data_c) {
+                cflt_comp_put(ct);
+                return -ENOMEM;
+        }
+
+        cflt_file_idx_invalidate(f, fh);
+
+        list_for_each_entry_safe(blk, tmp, &fh->wb, wb_list) {
+                // not placed in the file yet
+                new = list_empty(&blk->file);
+
+                // updates blk->size_c
+                blk->data_u = blk->wb;
+                blk->data_c = data_c;
+                err = cflt_block_write(f, blk, ct->tfm);
+                blk->data_u = blk->data_c = NULL;
+                if (err)
+                        break;
+
+                if (new)
+                        cflt_file_add_blk(fh, blk);
+
+                cflt_cache_add(blk, blk->wb, blk->ver);
+                cflt_wb_clean(blk);
+        }
+
+        cflt_buf_put(data_c);
+        cflt_comp_put(ct);
+        return err;
+}
+
+// forget the dirty data of @fh, blocks not placed in the file yet are freed
+void cflt_wb_drop(struct cflt_file *fh)
+{
+        struct cflt_block *blk;
+        struct cflt_block *tmp;
+
+        cflt_debug_printk("compflt: [f:cflt_wb_drop]\n");
+
+        list_for_each_entry_safe(blk, tmp, &fh->wb, wb_list) {
+                cflt_wb_clean(blk);
+
+                if (list_empty(&blk->file))
+                        cflt_block_deinit(blk);
+        }
+}
+
+int cflt_wb_size_set(unsigned long int new)
+{
+        cflt_wb_max = new << 10;
+        printk(KERN_INFO "compflt: write-back size set to %li KB\n", new);
+
+        return 0;
+}
+
+int cflt_wb_size_get(char* buf, int bsize)
+{
+        int len = 0;
+        len = sprintf(buf, "%li\n", cflt_wb_max >> 10);
+        return len;
+}
@@ -6,13 +6,21 @@
  */
 
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <fcntl.h>
 #include <string.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
 #include "av.h"
 
+#define AV_CMD_SIZE 256
+
 static int av_open_conn(struct av_connection *conn, int flags)
 {
 	if (!conn) {
@@ -54,11 +62,59 @@ int av_unregister_trusted(struct av_connection *conn)
 	return av_unregister(conn);
 }
 
+static int av_parse_event(const char *buf, struct av_event *event)
+{
+	int rv;
+
+	event->id = -1;
+	event->fd = -1;
+	event->limit = 0;
+
+	/*
+	 * v0: id:%d,type:%d,fd:%d,pid:%d,tgid:%d
+	 * v1: id:%d,type:%d,fd:%d,pid:%d,tgid:%d,limit:%lld
+	 */
+	rv = sscanf(buf, "id:%d,type:%d,fd:%d,pid:%d,tgid:%d,limit:%lld",
+			&event->id, &event->type, &event->fd, &event->pid,
+			&event->tgid, &event->limit);
+	if (rv != 5 && rv != 6)
+		return -1;
+
+	event->res = 0;
+	event->cache = AV_CACHE_ENABLE;
+	event->content = NULL;
+	event->content_len = 0;
+	event->content_mapped = 0;
+
+	return 0;
+}
+
+static void av_release_content(struct av_event *event)
+{
+	if (!event->content)
+		return;
+
+	if (event->content_mapped)
+		munmap(event->content, event->content_len);
+	else
+		free(event->content);
+
+	event->content = NULL;
+	event->content_len = 0;
+	event->content_mapped = 0;
+}
+
+static int av_format_reply(char *buf, struct av_event *event)
+{
+	return snprintf(buf, AV_CMD_SIZE, "id:%d,res:%d,cache:%d", event->id,
+			event->res, event->cache) + 1;
+}
+
 int av_request(struct av_connection *conn, struct av_event *event, int timeout)
 {
 	struct timeval tv;
 	struct timeval *ptv;
-	char buf[256];
+	char buf[AV_CMD_SIZE];
 	fd_set rfds;
 	int rv = 0;
 
@@ -86,35 +142,28 @@ int av_request(struct av_connection *conn, struct av_event *event, int timeout)
 		if (rv == -1)
 			return -1;
 
-		rv = read(conn->fd, buf, 256);
+		rv = read(conn->fd, buf, AV_CMD_SIZE);
 		if (rv == -1)
 			return -1;
 	}
 
-	if (sscanf(buf, "id:%d,type:%d,fd:%d,pid:%d,tgid:%d",
-				&event->id, &event->type, &event->fd,
-				&event->pid, &event->tgid) != 5)
-		return -1;
-
-	event->res = 0;
-	event->cache = AV_CACHE_ENABLE;
-
-	return 0;
+	return av_parse_event(buf, event);
 }
 
 int av_reply(struct av_connection *conn, struct av_event *event)
 {
-	char buf[256];
+	char buf[AV_CMD_SIZE];
+	int len;
 
 	if (!conn || !event) {
 		errno = EINVAL;
 		return -1;
 	}
 
-	snprintf(buf, 256, "id:%d,res:%d,cache:%d", event->id, event->res,
-			event->cache);
+	len = av_format_reply(buf, event);
+	av_release_content(event);
 
-	if (write(conn->fd, buf, strlen(buf) + 1) == -1)
+	if (write(conn->fd, buf, len) == -1)
 		return -1;
 
 	if (close(event->fd) == -1)
@@ -123,6 +172,24 @@ int av_reply(struct av_connection *conn, struct av_event *event)
 	return 0;
 }
 
+int av_extend(struct av_connection *conn, struct av_event *event, int msecs)
+{
+	char buf[AV_CMD_SIZE];
+	int len;
+
+	if (!conn || !event || msecs < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	len = snprintf(buf, AV_CMD_SIZE, "id:%d,ext:%d", event->id, msecs) + 1;
+
+	if (write(conn->fd, buf, len) == -1)
+		return -1;
+
+	return 0;
+}
+
 int av_set_result(struct av_event *event, int res)
 {
 	if (!event) {
@@ -176,3 +243,391 @@ int av_get_filename(struct av_event *event, char *buf, int size)
 	return 0;
 }
 
+static int av_get_size(struct av_event *event, off_t *size)
+{
+	struct stat st;
+
+	if (fstat(event->fd, &st) == -1)
+		return -1;
+
+	if (event->limit && event->limit < st.st_size)
+		*size = event->limit;
+	else
+		*size = st.st_size;
+
+	return 0;
+}
+
+static ssize_t av_pread_full(int fd, char *buf, size_t len, off_t off)
+{
+	size_t done = 0;
+	ssize_t rv;
+
+	while (done < len) {
+		rv = pread(fd, buf + done, len - done, off + done);
+		if (rv == -1) {
+			if (errno == EINTR)
+				continue;
+
+			return -1;
+		}
+
+		if (!rv)
+			break;
+
+		done += rv;
+	}
+
+	return done;
+}
+
+int av_map_content(struct av_event *event, const void **ptr, size_t *len)
+{
+	void *buf;
+	ssize_t rv;
+	off_t size;
+
+	if (!event || !ptr || !len) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (event->content) {
+		*ptr = event->content;
+		*len = event->content_len;
+		return 0;
+	}
+
+	if (av_get_size(event, &size))
+		return -1;
+
+	*ptr = NULL;
+	*len = 0;
+
+	if (!size)
+		return 0;
+
+	if (size != (size_t)size) {
+		errno = EFBIG;
+		return -1;
+	}
+
+	posix_fadvise(event->fd, 0, size, POSIX_FADV_WILLNEED);
+
+	buf = mmap(NULL, size, PROT_READ, MAP_PRIVATE, event->fd, 0);
+	if (buf != MAP_FAILED) {
+		madvise(buf, size, MADV_SEQUENTIAL);
+		event->content_mapped = 1;
+		goto exit;
+	}
+
+	/* big files which cannot be mapped have to be read by av_read_chunks */
+	if (size > AV_MAP_READ_MAX) {
+		errno = EFBIG;
+		return -1;
+	}
+
+	if (posix_memalign(&buf, sysconf(_SC_PAGESIZE), size)) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	rv = av_pread_full(event->fd, buf, size, 0);
+	if (rv == -1) {
+		free(buf);
+		return -1;
+	}
+
+	size = rv;
+	event->content_mapped = 0;
+exit:
+	event->content = buf;
+	event->content_len = size;
+	*ptr = buf;
+	*len = size;
+	return 0;
+}
+
+int av_read_chunks(struct av_event *event, av_chunk_callback callback,
+		void *data)
+{
+	void *buf;
+	ssize_t rv;
+	off_t size;
+	size_t len;
+	off_t off = 0;
+
+	if (!event || !callback) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (av_get_size(event, &size))
+		return -1;
+
+	if (!size)
+		return 0;
+
+	if (posix_memalign(&buf, sysconf(_SC_PAGESIZE), AV_CHUNK_SIZE)) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	posix_fadvise(event->fd, 0, size, POSIX_FADV_SEQUENTIAL);
+
+	while (off < size) {
+		len = size - off;
+		if (len > AV_CHUNK_SIZE)
+			len = AV_CHUNK_SIZE;
+
+		rv = av_pread_full(event->fd, buf, len, off);
+		if (rv <= 0)
+			break;
+
+		if (callback(buf, rv, off, data)) {
+			rv = -1;
+			errno = ECANCELED;
+			break;
+		}
+
+		off += rv;
+	}
+
+	free(buf);
+
+	if (rv == -1)
+		return -1;
+
+	return 0;
+}
+
+static int av_loop_batch(struct av_loop *loop, char *rbuf, char *wbuf,
+		struct av_event *events)
+{
+	struct epoll_event ev;
+	int stop = 0;
+	int rlen;
+	int wlen;
+	int off;
+	int cnt;
+	int n;
+	int i;
+
+	rlen = read(loop->conn->fd, rbuf, AV_BATCH_SIZE * AV_CMD_SIZE);
+	if (rlen == -1 && errno != EINTR && errno != EAGAIN)
+		return -1;
+
+	/*
+	 * The connection is armed for one worker at a time, re-arm it so the
+	 * next batch can be read by another worker while this one scans.
+	 */
+	memset(&ev, 0, sizeof(struct epoll_event));
+	ev.events = EPOLLIN | EPOLLONESHOT;
+	ev.data.fd = loop->conn->fd;
+	if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, loop->conn->fd, &ev) == -1)
+		return -1;
+
+	if (rlen == -1)
+		return 0;
+
+	if (rlen > 0)
+		rbuf[rlen - 1] = '\0';
+
+	/*
+	 * A read may return more events than AV_BATCH_SIZE if they are short,
+	 * they are scanned and replied in batches of at most AV_BATCH_SIZE.
+	 */
+	for (off = 0; off < rlen;) {
+		for (cnt = 0, wlen = 0, n = 0; off < rlen && n < AV_BATCH_SIZE;) {
+			i = av_parse_event(rbuf + off, &events[cnt]);
+			off += strlen(rbuf + off) + 1;
+
+			if (!i) {
+				cnt++;
+				n++;
+				continue;
+			}
+
+			/*
+			 * Do not scan the malformed event and do not leak its
+			 * fd. If its id is known, reply with the default
+			 * verdict, so it does not wait for the timeout.
+			 */
+			if (events[cnt].fd != -1)
+				close(events[cnt].fd);
+
+			if (events[cnt].id == -1)
+				continue;
+
+			events[cnt].res = 0;
+			events[cnt].cache = AV_CACHE_DISABLE;
+			wlen += av_format_reply(wbuf + wlen, &events[cnt]);
+			n++;
+		}
+
+		for (i = 0; i < cnt; i++) {
+			if (loop->callback(&events[i], loop->data))
+				stop = 1;
+
+			wlen += av_format_reply(wbuf + wlen, &events[i]);
+			av_release_content(&events[i]);
+			close(events[i].fd);
+		}
+
+		if (wlen && write(loop->conn->fd, wbuf, wlen) == -1 &&
+				errno != ENOENT)
+			return -1;
+	}
+
+	if (stop) {
+		errno = ECANCELED;
+		return -1;
+	}
+
+	return 0;
+}
+
+static void *av_loop_worker(void *data)
+{
+	struct av_loop *loop = data;
+	struct av_event events[AV_BATCH_SIZE];
+	char rbuf[AV_BATCH_SIZE * AV_CMD_SIZE];
+	char wbuf[AV_BATCH_SIZE * AV_CMD_SIZE];
+	struct epoll_event ev;
+	int rv;
+
+	for (;;) {
+		rv = epoll_wait(loop->epoll_fd, &ev, 1, -1);
+		if (rv == -1) {
+			if (errno == EINTR)
+				continue;
+
+			break;
+		}
+
+		if (ev.data.fd == loop->event_fd)
+			return NULL;
+
+		if (av_loop_batch(loop, rbuf, wbuf, events))
+			break;
+	}
+
+	__sync_bool_compare_and_swap(&loop->error, 0, errno);
+	av_loop_stop(loop);
+
+	return NULL;
+}
+
+int av_loop_init(struct av_loop *loop, struct av_connection *conn,
+		int threads, av_callback callback, void *data)
+{
+	struct epoll_event ev;
+
+	if (!loop || !conn || !callback || threads < 1) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	memset(loop, 0, sizeof(struct av_loop));
+	loop->conn = conn;
+	loop->callback = callback;
+	loop->data = data;
+	loop->threads = threads;
+
+	loop->epoll_fd = epoll_create(2);
+	if (loop->epoll_fd == -1)
+		return -1;
+
+	loop->event_fd = eventfd(0, 0);
+	if (loop->event_fd == -1)
+		goto err_epoll;
+
+	/* only one worker is woken up for each batch of requests */
+	memset(&ev, 0, sizeof(struct epoll_event));
+	ev.events = EPOLLIN | EPOLLONESHOT;
+	ev.data.fd = conn->fd;
+	if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, conn->fd, &ev) == -1)
+		goto err_event;
+
+	/* stop wakes up all workers */
+	ev.events = EPOLLIN;
+	ev.data.fd = loop->event_fd;
+	if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->event_fd, &ev) == -1)
+		goto err_event;
+
+	return 0;
+
+err_event:
+	close(loop->event_fd);
+err_epoll:
+	close(loop->epoll_fd);
+	return -1;
+}
+
+int av_loop_run(struct av_loop *loop)
+{
+	pthread_t *threads;
+	int rv;
+	int i;
+
+	if (!loop) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	threads = malloc(sizeof(pthread_t) * loop->threads);
+	if (!threads)
+		return -1;
+
+	for (i = 1; i < loop->threads; i++) {
+		rv = pthread_create(&threads[i], NULL, av_loop_worker, loop);
+		if (rv) {
+			__sync_bool_compare_and_swap(&loop->error, 0, rv);
+			av_loop_stop(loop);
+			break;
+		}
+	}
+
+	av_loop_worker(loop);
+
+	while (--i > 0)
+		pthread_join(threads[i], NULL);
+
+	free(threads);
+
+	if (loop->error) {
+		errno = loop->error;
+		return -1;
+	}
+
+	return 0;
+}
+
+int av_loop_stop(struct av_loop *loop)
+{
+	uint64_t val = 1;
+
+	if (!loop) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (write(loop->event_fd, &val, sizeof(uint64_t)) == -1)
+		return -1;
+
+	return 0;
+}
+
+int av_loop_exit(struct av_loop *loop)
+{
+	if (!loop) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	close(loop->event_fd);
+	close(loop->epoll_fd);
+
+	return 0;
+}
+
@@ -19,6 +19,10 @@
 #define AV_CACHE_DISABLE 0
 #define AV_CACHE_ENABLE  1
 
+#define AV_BATCH_SIZE 16
+#define AV_CHUNK_SIZE (1024 * 1024)
+#define AV_MAP_READ_MAX (16 * AV_CHUNK_SIZE)
+
 struct av_connection {
 	int fd;
 };
@@ -31,6 +35,24 @@ struct av_event {
 	pid_t tgid;
 	int res;
 	int cache;
+	long long limit;
+	void *content;
+	size_t content_len;
+	int content_mapped;
+};
+
+typedef int (*av_callback)(struct av_event *event, void *data);
+typedef int (*av_chunk_callback)(const void *buf, size_t len, off_t off,
+		void *data);
+
+struct av_loop {
+	struct av_connection *conn;
+	av_callback callback;
+	void *data;
+	int threads;
+	int epoll_fd;
+	int event_fd;
+	int error;
 };
 
 int av_register(struct av_connection *conn);
@@ -39,9 +61,18 @@ int av_register_trusted(struct av_connection *conn);
 int av_unregister_trusted(struct av_connection *conn);
 int av_request(struct av_connection *conn, struct av_event *event, int timeout);
 int av_reply(struct av_connection *conn, struct av_event *event);
+int av_extend(struct av_connection *conn, struct av_event *event, int msecs);
 int av_set_result(struct av_event *event, int res);
 int av_set_cache(struct av_event *event, int cache);
 int av_get_filename(struct av_event *event, char *buf, int size);
+int av_map_content(struct av_event *event, const void **ptr, size_t *len);
+int av_read_chunks(struct av_event *event, av_chunk_callback callback,
+		void *data);
+int av_loop_init(struct av_loop *loop, struct av_connection *conn,
+		int threads, av_callback callback, void *data);
+int av_loop_run(struct av_loop *loop);
+int av_loop_stop(struct av_loop *loop);
+int av_loop_exit(struct av_loop *loop);
 
 #endif
 
@@ -139,13 +139,14 @@ enum redirfs_op_id {
 
 	REDIRFS_REG_FOP_OPEN,
 	REDIRFS_REG_FOP_RELEASE,
-	/* REDIRFS_REG_FOP_LLSEEK, */
-	/* REDIRFS_REG_FOP_READ, */
-	/* REDIRFS_REG_FOP_WRITE, */
+	REDIRFS_REG_FOP_LLSEEK,
+	REDIRFS_REG_FOP_READ,
+	REDIRFS_REG_FOP_WRITE,
 	/* REDIRFS_REG_FOP_AIO_READ, */
 	/* REDIRFS_REG_FOP_AIO_WRITE, */
-	/* REDIRFS_REG_FOP_MMAP, */
-	/* REDIRFS_REG_FOP_FLUSH, */
+	REDIRFS_REG_FOP_MMAP,
+	REDIRFS_REG_FOP_FLUSH,
+	REDIRFS_REG_FOP_FSYNC,
 
 	REDIRFS_DIR_FOP_OPEN,
 	REDIRFS_DIR_FOP_RELEASE,
@@ -373,19 +374,35 @@ union redirfs_op_args {
 		struct file *file;
 	} f_release;
 
-	/*
 	struct {
 		struct file *file;
 		fl_owner_t id;
 	} f_flush;
-	*/
 
-	/*
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,35)
+	struct {
+		struct file *file;
+		struct dentry *dentry;
+		int datasync;
+	} f_fsync;
+#elif LINUX_VERSION_CODE < KERNEL_VERSION(3,1,0)
+	struct {
+		struct file *file;
+		int datasync;
+	} f_fsync;
+#else
+	struct {
+		struct file *file;
+		loff_t start;
+		loff_t end;
+		int datasync;
+	} f_fsync;
+#endif
+
 	struct {
 		struct file *file;
 		struct vm_area_struct *vma;
 	} f_mmap;
-	*/
 
 	struct {
 		struct file *file;
@@ -393,31 +410,25 @@ union redirfs_op_args {
 		filldir_t filldir;
 	} f_readdir;
 
-	/*
 	struct {
-                struct file *file;
-                loff_t offset;
-                int origin;
+		struct file *file;
+		loff_t offset;
+		int origin;
 	} f_llseek;
-	*/
 
-	/*
 	struct {
 		struct file *file;
 		char __user *buf;
 		size_t count;
 		loff_t *pos;
 	} f_read;
-	*/
 
-	/*
 	struct {
 		struct file *file;
 		const char __user *buf;
 		size_t count;
 		loff_t *pos;
 	} f_write;
-	*/
 
 	/*
 	struct {
@@ -648,6 +659,10 @@ int redirfs_activate_filter(redirfs_filter filter);
 int redirfs_deactivate_filter(redirfs_filter filter);
 int redirfs_get_filename(struct vfsmount *mnt, struct dentry *dentry, char *buf,
 		int size);
+ssize_t redirfs_orig_read(struct file *file, char __user *buf, size_t count,
+		loff_t *pos);
+ssize_t redirfs_orig_write(struct file *file, const char __user *buf,
+		size_t count, loff_t *pos);
 int redirfs_init_data(struct redirfs_data *data, redirfs_filter filter,
 		void (*free)(struct redirfs_data *),
 		void (*detach)(struct redirfs_data *));
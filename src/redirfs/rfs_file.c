@@ -304,8 +304,312 @@ exit:
 	return rargs.rv.rv_int;
 }
 
+static loff_t rfs_llseek(struct file *file, loff_t offset, int origin)
+{
+	struct rfs_file *rfile;
+	struct rfs_info *rinfo;
+	struct rfs_context rcont;
+	struct redirfs_args rargs;
+
+	rfile = rfs_file_find(file);
+	rinfo = rfs_dentry_get_rinfo(rfile->rdentry);
+	rfs_context_init(&rcont, 0);
+
+	rargs.type.id = REDIRFS_REG_FOP_LLSEEK;
+	rargs.args.f_llseek.file = file;
+	rargs.args.f_llseek.offset = offset;
+	rargs.args.f_llseek.origin = origin;
+
+	if (!rfs_precall_flts(rinfo->rchain, &rcont, &rargs)) {
+		if (rfile->op_old && rfile->op_old->llseek)
+			rargs.rv.rv_loff = rfile->op_old->llseek(
+					rargs.args.f_llseek.file,
+					rargs.args.f_llseek.offset,
+					rargs.args.f_llseek.origin);
+		else
+			rargs.rv.rv_loff = default_llseek(
+					rargs.args.f_llseek.file,
+					rargs.args.f_llseek.offset,
+					rargs.args.f_llseek.origin);
+	}
+
+	rfs_postcall_flts(rinfo->rchain, &rcont, &rargs);
+	rfs_context_deinit(&rcont);
+
+	rfs_file_put(rfile);
+	rfs_info_put(rinfo);
+	return rargs.rv.rv_loff;
+}
+
+static ssize_t rfs_read(struct file *file, char __user *buf, size_t count,
+		loff_t *pos)
+{
+	struct rfs_file *rfile;
+	struct rfs_info *rinfo;
+	struct rfs_context rcont;
+	struct redirfs_args rargs;
+
+	rfile = rfs_file_find(file);
+	rinfo = rfs_dentry_get_rinfo(rfile->rdentry);
+	rfs_context_init(&rcont, 0);
+
+	rargs.type.id = REDIRFS_REG_FOP_READ;
+	rargs.args.f_read.file = file;
+	rargs.args.f_read.buf = buf;
+	rargs.args.f_read.count = count;
+	rargs.args.f_read.pos = pos;
+
+	if (!rfs_precall_flts(rinfo->rchain, &rcont, &rargs)) {
+		if (rfile->op_old && rfile->op_old->read)
+			rargs.rv.rv_ssize = rfile->op_old->read(
+					rargs.args.f_read.file,
+					rargs.args.f_read.buf,
+					rargs.args.f_read.count,
+					rargs.args.f_read.pos);
+		else
+			rargs.rv.rv_ssize = -EINVAL;
+	}
+
+	rfs_postcall_flts(rinfo->rchain, &rcont, &rargs);
+	rfs_context_deinit(&rcont);
+
+	rfs_file_put(rfile);
+	rfs_info_put(rinfo);
+	return rargs.rv.rv_ssize;
+}
+
+static ssize_t rfs_write(struct file *file, const char __user *buf,
+		size_t count, loff_t *pos)
+{
+	struct rfs_file *rfile;
+	struct rfs_info *rinfo;
+	struct rfs_context rcont;
+	struct redirfs_args rargs;
+
+	rfile = rfs_file_find(file);
+	rinfo = rfs_dentry_get_rinfo(rfile->rdentry);
+	rfs_context_init(&rcont, 0);
+
+	rargs.type.id = REDIRFS_REG_FOP_WRITE;
+	rargs.args.f_write.file = file;
+	rargs.args.f_write.buf = buf;
+	rargs.args.f_write.count = count;
+	rargs.args.f_write.pos = pos;
+
+	if (!rfs_precall_flts(rinfo->rchain, &rcont, &rargs)) {
+		if (rfile->op_old && rfile->op_old->write)
+			rargs.rv.rv_ssize = rfile->op_old->write(
+					rargs.args.f_write.file,
+					rargs.args.f_write.buf,
+					rargs.args.f_write.count,
+					rargs.args.f_write.pos);
+		else
+			rargs.rv.rv_ssize = -EINVAL;
+	}
+
+	rfs_postcall_flts(rinfo->rchain, &rcont, &rargs);
+	rfs_context_deinit(&rcont);
+
+	rfs_file_put(rfile);
+	rfs_info_put(rinfo);
+	return rargs.rv.rv_ssize;
+}
+
+static int rfs_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct rfs_file *rfile;
+	struct rfs_info *rinfo;
+	struct rfs_context rcont;
+	struct redirfs_args rargs;
+
+	rfile = rfs_file_find(file);
+	rinfo = rfs_dentry_get_rinfo(rfile->rdentry);
+	rfs_context_init(&rcont, 0);
+
+	rargs.type.id = REDIRFS_REG_FOP_MMAP;
+	rargs.args.f_mmap.file = file;
+	rargs.args.f_mmap.vma = vma;
+
+	if (!rfs_precall_flts(rinfo->rchain, &rcont, &rargs)) {
+		if (rfile->op_old && rfile->op_old->mmap)
+			rargs.rv.rv_int = rfile->op_old->mmap(
+					rargs.args.f_mmap.file,
+					rargs.args.f_mmap.vma);
+		else
+			rargs.rv.rv_int = -ENODEV;
+	}
+
+	rfs_postcall_flts(rinfo->rchain, &rcont, &rargs);
+	rfs_context_deinit(&rcont);
+
+	rfs_file_put(rfile);
+	rfs_info_put(rinfo);
+	return rargs.rv.rv_int;
+}
+
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(2,6,18))
+static int rfs_flush(struct file *file)
+#else
+static int rfs_flush(struct file *file, fl_owner_t id)
+#endif
+{
+	struct rfs_file *rfile;
+	struct rfs_info *rinfo;
+	struct rfs_context rcont;
+	struct redirfs_args rargs;
+
+	rfile = rfs_file_find(file);
+	rinfo = rfs_dentry_get_rinfo(rfile->rdentry);
+	rfs_context_init(&rcont, 0);
+
+	rargs.type.id = REDIRFS_REG_FOP_FLUSH;
+	rargs.args.f_flush.file = file;
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(2,6,18))
+	rargs.args.f_flush.id = NULL;
+#else
+	rargs.args.f_flush.id = id;
+#endif
+
+	if (!rfs_precall_flts(rinfo->rchain, &rcont, &rargs)) {
+		if (rfile->op_old && rfile->op_old->flush)
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(2,6,18))
+			rargs.rv.rv_int = rfile->op_old->flush(
+					rargs.args.f_flush.file);
+#else
+			rargs.rv.rv_int = rfile->op_old->flush(
+					rargs.args.f_flush.file,
+					rargs.args.f_flush.id);
+#endif
+		else
+			rargs.rv.rv_int = 0;
+	}
+
+	rfs_postcall_flts(rinfo->rchain, &rcont, &rargs);
+	rfs_context_deinit(&rcont);
+
+	rfs_file_put(rfile);
+	rfs_info_put(rinfo);
+	return rargs.rv.rv_int;
+}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,35)
+static int rfs_fsync(struct file *file, struct dentry *dentry, int datasync)
+#elif LINUX_VERSION_CODE < KERNEL_VERSION(3,1,0)
+static int rfs_fsync(struct file *file, int datasync)
+#else
+static int rfs_fsync(struct file *file, loff_t start, loff_t end, int datasync)
+#endif
+{
+	struct rfs_file *rfile;
+	struct rfs_info *rinfo;
+	struct rfs_context rcont;
+	struct redirfs_args rargs;
+
+	rfile = rfs_file_find(file);
+	rinfo = rfs_dentry_get_rinfo(rfile->rdentry);
+	rfs_context_init(&rcont, 0);
+
+	rargs.type.id = REDIRFS_REG_FOP_FSYNC;
+	rargs.args.f_fsync.file = file;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,35)
+	rargs.args.f_fsync.dentry = dentry;
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(3,1,0)
+	rargs.args.f_fsync.start = start;
+	rargs.args.f_fsync.end = end;
+#endif
+	rargs.args.f_fsync.datasync = datasync;
+
+	if (!rfs_precall_flts(rinfo->rchain, &rcont, &rargs)) {
+		if (rfile->op_old && rfile->op_old->fsync)
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,35)
+			rargs.rv.rv_int = rfile->op_old->fsync(
+					rargs.args.f_fsync.file,
+					rargs.args.f_fsync.dentry,
+					rargs.args.f_fsync.datasync);
+#elif LINUX_VERSION_CODE < KERNEL_VERSION(3,1,0)
+			rargs.rv.rv_int = rfile->op_old->fsync(
+					rargs.args.f_fsync.file,
+					rargs.args.f_fsync.datasync);
+#else
+			rargs.rv.rv_int = rfile->op_old->fsync(
+					rargs.args.f_fsync.file,
+					rargs.args.f_fsync.start,
+					rargs.args.f_fsync.end,
+					rargs.args.f_fsync.datasync);
+#endif
+		else
+			rargs.rv.rv_int = -EINVAL;
+	}
+
+	rfs_postcall_flts(rinfo->rchain, &rcont, &rargs);
+	rfs_context_deinit(&rcont);
+
+	rfs_file_put(rfile);
+	rfs_info_put(rinfo);
+	return rargs.rv.rv_int;
+}
+
+/*
+ * Calls the read operation the file had before redirfs replaced it, so no
+ * filter sees the call. Used by filters which keep their own data in the
+ * file, e.g. compressed blocks.
+ */
+ssize_t redirfs_orig_read(struct file *file, char __user *buf, size_t count,
+		loff_t *pos)
+{
+	struct rfs_file *rfile;
+	ssize_t rv;
+
+	rfile = rfs_file_find(file);
+	if (!rfile) {
+		if (file->f_op && file->f_op->read)
+			return file->f_op->read(file, buf, count, pos);
+		return -EINVAL;
+	}
+
+	if (rfile->op_old && rfile->op_old->read)
+		rv = rfile->op_old->read(file, buf, count, pos);
+	else
+		rv = -EINVAL;
+
+	rfs_file_put(rfile);
+	return rv;
+}
+
+/*
+ * Calls the write operation the file had before redirfs replaced it, see
+ * redirfs_orig_read.
+ */
+ssize_t redirfs_orig_write(struct file *file, const char __user *buf,
+		size_t count, loff_t *pos)
+{
+	struct rfs_file *rfile;
+	ssize_t rv;
+
+	rfile = rfs_file_find(file);
+	if (!rfile) {
+		if (file->f_op && file->f_op->write)
+			return file->f_op->write(file, buf, count, pos);
+		return -EINVAL;
+	}
+
+	if (rfile->op_old && rfile->op_old->write)
+		rv = rfile->op_old->write(file, buf, count, pos);
+	else
+		rv = -EINVAL;
+
+	rfs_file_put(rfile);
+	return rv;
+}
+
 static void rfs_file_set_ops_reg(struct rfs_file *rfile)
 {
+	RFS_SET_FOP(rfile, REDIRFS_REG_FOP_LLSEEK, llseek);
+	RFS_SET_FOP(rfile, REDIRFS_REG_FOP_READ, read);
+	RFS_SET_FOP(rfile, REDIRFS_REG_FOP_WRITE, write);
+	RFS_SET_FOP(rfile, REDIRFS_REG_FOP_MMAP, mmap);
+	RFS_SET_FOP(rfile, REDIRFS_REG_FOP_FLUSH, flush);
+	RFS_SET_FOP(rfile, REDIRFS_REG_FOP_FSYNC, fsync);
 }
 
 static void rfs_file_set_ops_dir(struct rfs_file *rfile)
@@ -359,3 +663,6 @@ void rfs_file_set_ops(struct rfs_file *rfile)
 	rfile->op_new.release = rfs_release;
 }
 
+EXPORT_SYMBOL(redirfs_orig_read);
+EXPORT_SYMBOL(redirfs_orig_write);
+